@@ -3,8 +3,26 @@
 #include <limits>
 #include <vector>
 #include <algorithm>
-#include <fstream>
+#include <chrono>
+#include <charconv>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <deque>
+#include <atomic>
+#include <memory>
 #include <sstream>
+#include <unordered_map>
+#include <queue>
+#include <new>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define scp(pointer, message) {                                               \
     if (pointer == NULL) {                                                    \
@@ -25,22 +43,34 @@ SDL_Renderer *g_renderer;
 
 int screen_width;
 int screen_height;
+// size of what is being rendered into, less than the window while the resolution is scaled down
+int render_width;
+int render_height;
 
-void init() {
+void init(bool headless = false) {
+    /*
+     * headless: SDL's dummy video driver with a software SDL_Renderer and no
+     * VSYNC, so frames can be rendered and timed without a display
+     */
 
+    if (headless) {
+        SDL_SetHint(SDL_HINT_VIDEODRIVER, "dummy");
+    }
 	scc(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER), "Could not initialize SDL");
     if(!SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "1")) {
         SDL_Log("Warning: Linear texture filtering not enabled!");
     }
 
     scp((g_window = SDL_CreateWindow("ddd", 0, 0, screen_width, screen_height,
-        SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE)),
+        headless ? SDL_WINDOW_HIDDEN : SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE)),
             "Could not create window");
 
-    scp((g_renderer = SDL_CreateRenderer(g_window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC)),
+    scp((g_renderer = SDL_CreateRenderer(g_window, -1, headless ? SDL_RENDERER_SOFTWARE : SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC)),
             "Could not create renderer");
 
-    SDL_SetRelativeMouseMode(SDL_TRUE);
+    if (!headless) {
+        SDL_SetRelativeMouseMode(SDL_TRUE);
+    }
 }
 
 
@@ -116,6 +146,171 @@ Vec3 round(Vec3 p, float size = 1.0) {
 
 typedef Vec3 Point3D;
 
+struct Vec4 {
+    float x;
+    float y;
+    float z;
+    float w;
+};
+
+struct Mat4 {
+    /*
+     * row-major 4x4 matrix acting on column vectors: p' = M * p
+     * products compose right to left, so (A * B) applies B first
+     */
+    float m[4][4];
+
+    static Mat4 identity() {
+        return {{
+            { 1, 0, 0, 0 },
+            { 0, 1, 0, 0 },
+            { 0, 0, 1, 0 },
+            { 0, 0, 0, 1 },
+        }};
+    }
+
+    static Mat4 translation(Vec3 t) {
+        return {{
+            { 1, 0, 0, t.x },
+            { 0, 1, 0, t.y },
+            { 0, 0, 1, t.z },
+            { 0, 0, 0, 1   },
+        }};
+    }
+
+    static Mat4 scaling(float s) {
+        return {{
+            { s, 0, 0, 0 },
+            { 0, s, 0, 0 },
+            { 0, 0, s, 0 },
+            { 0, 0, 0, 1 },
+        }};
+    }
+
+    static Mat4 rotation_x(float angle) {
+        float c = cosf(angle), s = sinf(angle);
+        return {{
+            { 1, 0,  0, 0 },
+            { 0, c, -s, 0 },
+            { 0, s,  c, 0 },
+            { 0, 0,  0, 1 },
+        }};
+    }
+
+    static Mat4 rotation_y(float angle) {
+        float c = cosf(angle), s = sinf(angle);
+        return {{
+            {  c, 0, s, 0 },
+            {  0, 1, 0, 0 },
+            { -s, 0, c, 0 },
+            {  0, 0, 0, 1 },
+        }};
+    }
+
+    static Mat4 rotation_y_around_point(float angle, Point3D origin) {
+        return translation(origin) * rotation_y(angle) * translation(-origin);
+    }
+
+    Mat4 operator*(const Mat4 &o) const {
+        Mat4 r;
+        for (int i = 0; i < 4; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                r.m[i][j] = m[i][0] * o.m[0][j] + m[i][1] * o.m[1][j] + m[i][2] * o.m[2][j] + m[i][3] * o.m[3][j];
+            }
+        }
+        return r;
+    }
+
+    Vec4 transform(const Point3D &p) const {
+        return { m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                 m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                 m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3],
+                 m[3][0] * p.x + m[3][1] * p.y + m[3][2] * p.z + m[3][3] };
+    }
+
+    Vec3 transform_direction(const Vec3 &v) const {
+        /* ignores the translation, exact for normals as long as the matrix is a rotation (+ uniform scale) */
+        return { m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                 m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                 m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z };
+    }
+
+    Point3D transform_affine(const Point3D &p) const {
+        /* cheaper version for matrices whose last row is (0, 0, 0, 1) */
+        return { m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                 m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                 m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3] };
+    }
+
+    Mat4 inverse_rigid() const {
+        /* inverse of a rotation followed by a translation: the transposed rotation after undoing the translation */
+        Mat4 r = identity();
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 3; ++j) {
+                r.m[i][j] = m[j][i];
+            }
+            r.m[i][3] = -(m[0][i] * m[0][3] + m[1][i] * m[1][3] + m[2][i] * m[2][3]);
+        }
+        return r;
+    }
+};
+
+struct Plane {
+    /* points with n.dot(p) + d >= 0 are on the inner side */
+    Vec3 n;
+    float d;
+
+    float distance(Point3D p) const {
+        return n.x * p.x + n.y * p.y + n.z * p.z + d;
+    }
+};
+
+struct Box {
+    /* axis-aligned bounding box */
+    Vec3 min;
+    Vec3 max;
+
+    Box transformed(const Mat4 &matrix) const {
+        /* bounding box of the transformed corners */
+        Point3D first = matrix.transform_affine(min);
+        Box r = { first, first };
+        for (int i = 1; i < 8; ++i) {
+            Point3D p = matrix.transform_affine({ i & 1 ? max.x : min.x, i & 2 ? max.y : min.y, i & 4 ? max.z : min.z });
+            r.min = { std::min(r.min.x, p.x), std::min(r.min.y, p.y), std::min(r.min.z, p.z) };
+            r.max = { std::max(r.max.x, p.x), std::max(r.max.y, p.y), std::max(r.max.z, p.z) };
+        }
+        return r;
+    }
+
+    Box merged(const Box &o) const {
+        return { { std::min(min.x, o.min.x), std::min(min.y, o.min.y), std::min(min.z, o.min.z) },
+                 { std::max(max.x, o.max.x), std::max(max.y, o.max.y), std::max(max.z, o.max.z) } };
+    }
+
+    bool contains(const Box &o) const {
+        return min.x <= o.min.x && min.y <= o.min.y && min.z <= o.min.z
+            && max.x >= o.max.x && max.y >= o.max.y && max.z >= o.max.z;
+    }
+
+    float area() const {
+        /* half the surface area */
+        Vec3 d = max - min;
+        return d.x * d.y + d.y * d.z + d.z * d.x;
+    }
+
+    bool intersect_ray(Point3D origin, Vec3 inverse_dir, float max_t, float &t) const {
+        /* slab test, t is where the ray enters the box, 0 if it starts inside */
+        float t0 = (min.x - origin.x) * inverse_dir.x, t1 = (max.x - origin.x) * inverse_dir.x;
+        float enter = std::min(t0, t1), leave = std::max(t0, t1);
+        t0 = (min.y - origin.y) * inverse_dir.y, t1 = (max.y - origin.y) * inverse_dir.y;
+        enter = std::max(enter, std::min(t0, t1)), leave = std::min(leave, std::max(t0, t1));
+        t0 = (min.z - origin.z) * inverse_dir.z, t1 = (max.z - origin.z) * inverse_dir.z;
+        enter = std::max(enter, std::min(t0, t1)), leave = std::min(leave, std::max(t0, t1));
+        t = std::max(enter, 0.0f);
+        return t <= leave && t < max_t;
+    }
+};
+
 typedef Point3D Face[4];
 
 const Face cube_faces[] = {
@@ -145,6 +340,12 @@ const Face cube_faces[] = {
   },
 };
 
+// edges of the cube as pairs of indices into cube_points
+const int cube_edges[12][2] = {
+    {0, 1}, {1, 2}, {2, 3}, {3, 4}, {4, 5}, {5, 6}, {6, 7}, {7, 0},
+    {0, 3}, {1, 6}, {2, 5}, {4, 7},
+};
+
 const Point3D cube_points[] {
     { -0.5,  0.5,  -0.5 },
     {  0.5,  0.5,  -0.5 },
@@ -161,16 +362,22 @@ const Point3D cube_points[] {
 const double FOV = FOV_IN_DEGREES * M_PI / 180;
 const float tana2 = tan(FOV / 2);
 
+#define NEAR_PLANE 0.1f
+#define CLIP_PLANE_COUNT 5
+
 #define COLOR_RED 0xFF0333FF
 #define COLOR_GREEN 0x00FF00FF
 #define COLOR_BEIGE 0xF5F5DCFF
+#define COLOR_WHITE 0xFFFFFFFF
 
 #define UNHEX(color) color >> 3 * 8, color >> 2 * 8 & 0xFF, color >> 8 & 0xFF, color & 0xFF
 
 struct Player {
 
     Player(float x, float y, float z) 
-    : m_pos({x, y, z}), m_horizontal_view_angle(0.0), m_vertical_view_angle(0.0) {}
+    : m_pos({x, y, z}), m_horizontal_view_angle(0.0), m_vertical_view_angle(0.0) {
+        update_view();
+    }
 
     void move_forward(float d) {
         m_pos.z += std::cos(m_horizontal_view_angle) * d;
@@ -201,445 +408,4835 @@ struct Player {
         m_pos.z += dz;
     }
 
+    void look_at(Point3D target) {
+        /* inverse of the direction used by in_front() */
+        Vec3 d = target - m_pos;
+        float length = sqrtf(d.dot(d));
+        if (length == 0) return;
+        m_horizontal_view_angle = atan2f(d.x, d.z);
+        m_vertical_view_angle = asinf(std::clamp(d.y / length, -1.0f, 1.0f));
+    }
+
     Point3D in_front(float distance = 1) {
         return {m_pos.x + sin(-m_vertical_view_angle + (float) M_PI / 2) * cos(-m_horizontal_view_angle + (float) M_PI / 2) * distance,
         m_pos.y + cos(-m_vertical_view_angle + (float) M_PI / 2) * distance,
         m_pos.z + sin(-m_horizontal_view_angle + (float) M_PI / 2) * sin(-m_vertical_view_angle + (float) M_PI / 2) * distance};
     }
 
+    void update_view() {
+        /*
+         * recompute the camera matrices, once per frame before drawing
+         * view:       world -> camera space (camera at the origin looking down +z)
+         * projection: camera space -> clip space, w holds the depth
+         */
+        m_view = Mat4::rotation_x(m_vertical_view_angle) * Mat4::rotation_y(-m_horizontal_view_angle) * Mat4::translation(-m_pos);
+        m_projection = {{
+            { 1.0f / tana2, 0,            0, 0 },
+            { 0,            1.0f / tana2, 0, 0 },
+            { 0,            0,            1, 0 },
+            { 0,            0,            1, 0 },
+        }};
+        m_view_projection = m_projection * m_view;
+
+        /*
+         * clipping planes in camera space: the near plane and the four
+         * planes through the camera and the screen edges, following
+         * place_projected_point(): x / (z * tana2) must lie in [-0.5, 0.5]
+         * and y / (z * tana2) in [-h / 2w, h / 2w]
+         */
+        float half_w = 0.5f * tana2;
+        float half_h = 0.5f * tana2 * render_height / std::max(render_width, 1);
+        m_clip_planes[0] = { {  0, 0, 1      }, -NEAR_PLANE };
+        m_clip_planes[1] = { {  1, 0, half_w }, 0 };
+        m_clip_planes[2] = { { -1, 0, half_w }, 0 };
+        m_clip_planes[3] = { { 0,  1, half_h }, 0 };
+        m_clip_planes[4] = { { 0, -1, half_h }, 0 };
+
+        // the same planes in world space for culling: cam = R * (p - pos), so n_world = R^T * n
+        for (int i = 0; i < CLIP_PLANE_COUNT; ++i) {
+            const Vec3 &n = m_clip_planes[i].n;
+            Vec3 nw = { m_view.m[0][0] * n.x + m_view.m[1][0] * n.y + m_view.m[2][0] * n.z,
+                        m_view.m[0][1] * n.x + m_view.m[1][1] * n.y + m_view.m[2][1] * n.z,
+                        m_view.m[0][2] * n.x + m_view.m[1][2] * n.y + m_view.m[2][2] * n.z };
+            m_frustum[i] = { nw, m_clip_planes[i].d - nw.dot(m_pos) };
+        }
+    }
+
+    bool sees(const Box &box) const {
+        /* false only if the box is completely outside one of the frustum planes */
+        for (const Plane &p: m_frustum) {
+            // the corner furthest along the plane normal
+            Point3D corner = { p.n.x >= 0 ? box.max.x : box.min.x,
+                               p.n.y >= 0 ? box.max.y : box.min.y,
+                               p.n.z >= 0 ? box.max.z : box.min.z };
+            if (p.distance(corner) < 0) return false;
+        }
+        return true;
+    }
+
     Point3D m_pos;
     float m_vertical_view_angle;
     float m_horizontal_view_angle;
+
+    Mat4 m_view;
+    Mat4 m_projection;
+    Mat4 m_view_projection;
+
+    Plane m_clip_planes[CLIP_PLANE_COUNT]; // camera space
+    Plane m_frustum[CLIP_PLANE_COUNT];     // world space
 };
 
 /******************** Projection functions **********************************/
 
-inline Point3D rotate_y(float angle, Point3D p) {
-    return { p.x * cos(angle) + p.z * sin(angle),
-             p.y,
-             -sin(angle) * p.x + cos(angle) * p.z };
-}
-inline Point3D rotate_x(float angle, Point3D p) {
-    return { p.x, 
-             p.y * cos(angle) - p.z * sin(angle),
-             p.y * sin(angle) + p.z * cos(angle)};
-}
-
-inline Point3D rotate_y_around_point(float angle, Point3D p, Point3D origin) {
-    Point3D p1 = p - origin;
-    p1 = rotate_y(angle, p1);
-    return p1 + origin;
+inline Point2D project(Point3D p) {
+    /*
+     * p is in camera space: the camera sits at the origin looking down +z
+     * geometry is clipped against the near plane beforehand, the clamp only guards against division by zero
+     */
+    if (p.z < NEAR_PLANE) p.z = NEAR_PLANE;
+    return { p.x / (p.z * tana2), p.y / (p.z * tana2)};
 }
 
-inline Point2D project(Point3D p3, Player &player) {
-    p3 = p3 - player.m_pos;
-    if (p3.z < 0.1) p3.z = 0.1; // the coordinate is too big (overflows) for small z, so we clamp it
-    return { p3.x / (p3.z * tana2), p3.y / (p3.z * tana2)};
+inline Point2D project(Vec4 clip) {
+    /* perspective divide of a point produced by a projection matrix */
+    if (clip.w < NEAR_PLANE) clip.w = NEAR_PLANE;
+    return { clip.x / clip.w, clip.y / clip.w };
 }
 
-inline Point2D project_with_camera_horizontal(Point3D p, Player& player) {
-    return project(rotate_y_around_point(-player.m_horizontal_view_angle, p, player.m_pos), player);
+inline Point2D place_projected_point(Point2D point) {
+    return { (point.x * render_width) + render_width  * 0.5f,
+             (point.y * render_width) + render_height * 0.5f };
 }
 
-inline Point2D project_with_camera(Point3D p, Player& player) {
-    Point3D p1 = rotate_y(-player.m_horizontal_view_angle, p - player.m_pos);
-            p1 = rotate_x(player.m_vertical_view_angle,   p1);
-    return project(p1 + player.m_pos, player);
+inline int outcode(const Point3D &p, const Plane *planes) {
+    /* bit i is set if p is outside plane i */
+    int code = 0;
+    for (int i = 0; i < CLIP_PLANE_COUNT; ++i) {
+        if (planes[i].distance(p) < 0) code |= 1 << i;
+    }
+    return code;
 }
 
-inline Point2D project_with_camera(Point3D p, Player& player, Point3D &rotated) {
-    rotated = rotate_y(-player.m_horizontal_view_angle, p - player.m_pos);
-    rotated = rotate_x(player.m_vertical_view_angle, rotated);
-    return project(rotated + player.m_pos, player);
-}
+#define MAX_CLIPPED_VERTICES (3 + CLIP_PLANE_COUNT)
 
-inline Point3D get_camera_coords(Point3D p, Player& player) {
-    Point3D rotated = rotate_y(-player.m_horizontal_view_angle, p - player.m_pos);
-    rotated = rotate_x(player.m_vertical_view_angle, rotated);
-    return rotated + player.m_pos;
+int clip_polygon(Point3D *poly, int count, int plane_mask, const Plane *planes) {
+    /*
+     * Sutherland-Hodgman clipping of a convex polygon in place against the
+     * planes selected by plane_mask. poly must have room for
+     * MAX_CLIPPED_VERTICES points, returns the new vertex count.
+     */
+    Point3D out[MAX_CLIPPED_VERTICES];
+    for (int i = 0; i < CLIP_PLANE_COUNT && count > 0; ++i) {
+        if (!(plane_mask & 1 << i)) continue;
+        int out_count = 0;
+        for (int j = 0; j < count; ++j) {
+            const Point3D &a = poly[j], &b = poly[(j + 1) % count];
+            float da = planes[i].distance(a), db = planes[i].distance(b);
+            if (da >= 0) out[out_count++] = a;
+            if ((da >= 0) != (db >= 0)) out[out_count++] = a + (b - a) * (da / (da - db));
+        }
+        count = out_count;
+        std::copy(out, out + count, poly);
+    }
+    return count;
 }
 
-inline Point2D place_projected_point(Point2D point) {
-    //TODO: properly cut down lines that exceed the screen bounds (clipping)
-    return { std::clamp((point.x * screen_width) + screen_width  * 0.5f, -1000.0f, (float) screen_width  + 1000.0f),
-             std::clamp((point.y * screen_width) + screen_height * 0.5f, -1000.0f, (float) screen_height + 1000.0f) };
+bool clip_segment(Point3D &a, Point3D &b, const Plane *planes) {
+    /* clips the segment in place, returns false if nothing of it is left */
+    float t0 = 0, t1 = 1;
+    for (int i = 0; i < CLIP_PLANE_COUNT; ++i) {
+        float da = planes[i].distance(a), db = planes[i].distance(b);
+        if (da < 0 && db < 0) return false;
+        if (da < 0) t0 = std::max(t0, da / (da - db));
+        else if (db < 0) t1 = std::min(t1, da / (da - db));
+    }
+    if (t0 > t1) return false;
+    Point3D d = b - a;
+    b = a + d * t1;
+    a = a + d * t0;
+    return true;
 }
 
 inline Point2D get_onscreen_point(Point3D p, Player &player) {
-    return place_projected_point(project_with_camera(p, player));
+    return place_projected_point(project(player.m_view_projection.transform(p)));
 }
 
-/****************************************************************************/
+/******************** Debug text ********************************************/
 
-class Drawable {
-public:
-    void draw(SDL_Renderer *renderer, Player &player) {
-        if (active)
-            draw_impl(renderer, player);
-    }
-    bool switch_activation() {
-        return active = !active;
-    }
-protected:
-    bool active = true;
-private:
-    virtual void draw_impl(SDL_Renderer *renderer, Player &player) = 0;
+// 3x5 pixel glyphs, one bit per pixel, rows top to bottom, most significant bit first
+const struct { char c; uint16_t bits; } debug_font[] = {
+    { '%', 0x52A5 },
+    { '(', 0x2922 },
+    { ')', 0x224A },
+    { '+', 0x05D0 },
+    { '-', 0x01C0 },
+    { '.', 0x0002 },
+    { '/', 0x12A4 },
+    { '0', 0x7B6F },
+    { '1', 0x2C97 },
+    { '2', 0x73E7 },
+    { '3', 0x73CF },
+    { '4', 0x5BC9 },
+    { '5', 0x79CF },
+    { '6', 0x79EF },
+    { '7', 0x7249 },
+    { '8', 0x7BEF },
+    { '9', 0x7BCF },
+    { ':', 0x0410 },
+    { '=', 0x0E38 },
+    { 'A', 0x2BED },
+    { 'B', 0x6BAE },
+    { 'C', 0x3923 },
+    { 'D', 0x6B6E },
+    { 'E', 0x79A7 },
+    { 'F', 0x79A4 },
+    { 'G', 0x396B },
+    { 'H', 0x5BED },
+    { 'I', 0x7497 },
+    { 'J', 0x126A },
+    { 'K', 0x5BAD },
+    { 'L', 0x4927 },
+    { 'M', 0x5FED },
+    { 'N', 0x6B6D },
+    { 'O', 0x2B6A },
+    { 'P', 0x6BA4 },
+    { 'Q', 0x2B73 },
+    { 'R', 0x6BAD },
+    { 'S', 0x388E },
+    { 'T', 0x7492 },
+    { 'U', 0x5B6F },
+    { 'V', 0x5B6A },
+    { 'W', 0x5BFD },
+    { 'X', 0x5AAD },
+    { 'Y', 0x5A92 },
+    { 'Z', 0x72A7 },
+    { '_', 0x0007 },
 };
 
-struct Triangle {
-    Point3D vertices[3];
-
-    Triangle to_camera_coords(Player &player) {
-        return {get_camera_coords(vertices[0], player), get_camera_coords(vertices[1], player), get_camera_coords(vertices[2], player)};
-    }
-    Point3D get_normal() {
-        return (vertices[1] - vertices[0]).cross(vertices[2] - vertices[0]).normalise();
+int draw_debug_text(SDL_Renderer *renderer, int x, int y, const char *text, int scale = 2) {
+    /* draws text with the current draw color, lowercase is shown as uppercase; returns the width in pixels */
+    SDL_Rect pixels[15 * 64];
+    int count = 0;
+    int start_x = x;
+    for (const char *c = text; *c; ++c, x += 4 * scale) {
+        char upper = toupper(*c);
+        for (auto &g: debug_font) {
+            if (g.c != upper) continue;
+            for (int bit = 0; bit < 15; ++bit) {
+                if (!(g.bits >> (14 - bit) & 1)) continue;
+                pixels[count++] = { x + bit % 3 * scale, y + bit / 3 * scale, scale, scale };
+                if (count == sizeof pixels / sizeof *pixels) {
+                    SDL_RenderFillRects(renderer, pixels, count);
+                    count = 0;
+                }
+            }
+            break;
+        }
     }
-};
+    if (count) SDL_RenderFillRects(renderer, pixels, count);
+    return x - start_x;
+}
 
-struct Cube : Drawable {
-    Cube(Point3D pos, float scale, uint32_t color = COLOR_RED) : m_pos(pos), m_scale(scale), m_color(color) {
-        /*
-         * pos   - position of the center of the cube
-         * scale - the size of the cube
-         *
-         */
-    }
+/******************** Frame memory ******************************************/
 
-    void draw_impl(SDL_Renderer *renderer, Player &player) {
-        // draw order is: 0-1-2-3-4-5-6-7-0-3, 1-6, 2-5, 4-7
-        
-        SDL_SetRenderDrawColor(renderer, UNHEX(m_color));
+std::atomic<long> g_heap_allocations{0};
 
-        Point2D pts[10];
-        for (int i = 0; i < 8; ++i) {
-            pts[i] = get_onscreen_point(cube_points[i] * m_scale + m_pos, player);
-        }
-        pts[8] = pts[0];
-        pts[9] = pts[3];
-        SDL_RenderDrawLinesF(renderer, pts, 10);
-        SDL_RenderDrawLineF(renderer, pts[1].x, pts[1].y, pts[6].x, pts[6].y);
-        SDL_RenderDrawLineF(renderer, pts[2].x, pts[2].y, pts[5].x, pts[5].y);
-        SDL_RenderDrawLineF(renderer, pts[4].x, pts[4].y, pts[7].x, pts[7].y);
-    }
+// count every heap allocation, so steady-state frames can be checked to allocate nothing
+void *operator new(size_t size) {
+    ++g_heap_allocations;
+    if (void *p = malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void *operator new[](size_t size) {
+    ++g_heap_allocations;
+    if (void *p = malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept {
+    free(p);
+}
+void operator delete[](void *p) noexcept {
+    free(p);
+}
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+void operator delete[](void *p, size_t) noexcept {
+    free(p);
+}
 
-    void move(float x, float y = 0, float z = 0) {
-        m_pos.x += x;
-        m_pos.y += y;
-        m_pos.z += z;
-    }
+struct Frame_arena {
+    /*
+     * Bump allocator for the per-frame transform, sort and submission
+     * buffers, reset() once at the start of every frame. If a frame
+     * needed more than one block, the blocks are merged into one on reset,
+     * so after the first frames drawing does not touch the heap at all.
+     * Only used from the render thread.
+     */
 
-    Point3D getpos() {
-        return m_pos;
+    template <typename T>
+    T *alloc(size_t count) {
+        static_assert(std::is_trivially_copyable<T>::value, "frame arena memory is never destructed");
+        size_t bytes = (count * sizeof(T) + 15) & ~(size_t) 15;
+        if (m_blocks.empty() || m_offset + bytes > m_blocks[m_current].size) {
+            next_block(bytes);
+        }
+        T *p = (T *) (m_blocks[m_current].data.get() + m_offset);
+        m_offset += bytes;
+        m_used += bytes;
+        m_peak = std::max(m_peak, m_used);
+        return p;
     }
 
-    float get_top() {
-        return m_pos.y - m_scale * 0.5;
+    void reset() {
+        if (m_current > 0) {
+            // the last frame did not fit into one block, replace them all with one big enough
+            size_t total = 0;
+            for (auto &b: m_blocks) total += b.size;
+            m_blocks.clear();
+            m_blocks.push_back(Block(total));
+            ++m_block_allocations;
+        }
+        m_current = 0;
+        m_offset = 0;
+        m_used = 0;
+        ++m_generation;
     }
 
+    size_t used() const { return m_used; }
+    size_t peak() const { return m_peak; }
+    long block_allocations() const { return m_block_allocations; }
+    unsigned generation() const { return m_generation; }
+
 private:
-    float m_scale;
-    Point3D m_pos;
-    uint32_t m_color;
-};
+    struct Block {
+        Block(size_t size) : data(new char[size]), size(size) { }
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
 
-struct Mesh : Drawable {
+    static const size_t MIN_BLOCK_SIZE = 1 << 20;
 
-    Mesh(std::string filepath) : m_polygons(nullptr), m_count(0) {
-        /* create a mesh from an obj file */
-        std::ifstream f = std::ifstream(filepath);
-        if (!f.is_open()) {
-            std::cerr << "Error: failed to open " << filepath << '\n';
-            return;
-        }
-        std::vector<Vec3> verts;
-        std::vector<Vec3> normals;
-        std::vector<Triangle> tris;
-        int v_count = 0, n_count = 0;
-        char c;
-        int line_number = 0;
-        while (!f.eof()) {
-            std::string line;
-            std::getline(f, line);
-            ++line_number;
-            if (line.size() == 0 || line[0] == ' ') continue;
-            std::istringstream strstream(line);
-            strstream >> c;
-            switch (c) {
-                case '#':
-                case 'g':
-                    // do nothing
-                    break;
-                case 'v':
-                    if (strstream.peek() == 'n') {
-                        continue;
-                    }
-                    else {
-                        //vertex
-                        verts.push_back(parse_v3(strstream));
-                    }
-                    break;
-                case 'f':
-                    int v[3], n[3];
-                    for (int i = 0; i < 3; ++i) {
-                        strstream >> v[i];
-                        // ignore "//"
-                        if (strstream.peek() == '/') {
-                            strstream.ignore(2);
-                            strstream >> n[i];
-                        }
-                    }
-                    tris.push_back({{verts[v[0] - 1], verts[v[1] - 1], verts[v[2] - 1]}});
-                    break;
-                default:
-                    std::cerr << "Unknown symbol at line " << line_number << ": '" << c << '\'' << '\n';
-            }
+    std::vector<Block> m_blocks;
+    size_t m_current = 0;
+    size_t m_offset = 0;
+    size_t m_used = 0;
+    size_t m_peak = 0;
+    long m_block_allocations = 0;
+    unsigned m_generation = 0;
+
+    void next_block(size_t bytes) {
+        if (!m_blocks.empty() && m_current + 1 < m_blocks.size() && m_blocks[m_current + 1].size >= bytes) {
+            ++m_current;
+        } else {
+            size_t last = m_blocks.empty() ? 0 : m_blocks.back().size;
+            m_blocks.push_back(Block(std::max({ bytes, MIN_BLOCK_SIZE, last * 2 })));
+            m_current = m_blocks.size() - 1;
+            ++m_block_allocations;
         }
-        m_count = tris.size();
-        m_polygons = new Triangle[m_count];
-        std::copy(tris.begin(), tris.end(), m_polygons);
+        m_offset = 0;
     }
+};
 
-    void draw_impl(SDL_Renderer *renderer, Player &player) {
-        Triangle tris[m_count];
-        for (int i = 0; i < m_count; ++i) {
-            tris[i] = m_polygons[i].to_camera_coords(player);
-        }
-        //sort by z
-        //TODO: depth buffer
-        std::sort(tris, tris + m_count, [](Triangle &t1, Triangle &t2) {
-                float z1 = t1.vertices[0].z + t1.vertices[1].z + t1.vertices[2].z;
-                float z2 = t2.vertices[0].z + t2.vertices[1].z + t2.vertices[2].z;
-                return z1 > z2;
-        });
-        Point2D pts[4];
-
-        Vec3 light_direction = { 0.0f, 0.0f, 1.0f };
-        light_direction.normalise();
-        Point3D normal;
+Frame_arena g_frame_arena;
 
-        for (int i = 0; i < m_count; ++i) {
-            if ((normal = tris[i].get_normal()).dot(tris[i].vertices[0] - player.m_pos) >= 0) continue;
-            for (int j = 0; j < 3; ++j) {
-                pts[j] = place_projected_point(project(tris[i].vertices[j], player));
-            }
-            
-            uint8_t col = (-light_direction.dot(normal)) * 255;
+template <typename T>
+struct Frame_array {
+    /*
+     * Growable array in the frame arena. Growing leaves the old storage
+     * behind until the next reset; storage from a previous frame is
+     * dropped automatically, so the array can live in a long-lived object.
+     */
 
-            SDL_Vertex verts[3] =
-            {
-                { pts[0], SDL_Color{ col, col, col, 0xFF }, SDL_FPoint{ 0 }, },
-                { pts[1], SDL_Color{ col, col, col, 0xFF }, SDL_FPoint{ 0 }, },
-                { pts[2], SDL_Color{ col, col, col, 0xFF }, SDL_FPoint{ 0 }, },
-            };
-            SDL_RenderGeometry(renderer, nullptr, verts, 3, nullptr, 0);
-        }
+    void clear() {
+        fresh();
+        m_size = 0;
     }
 
-    void translate(float x, float y, float z) {
-        for (int i = 0; i < m_count; ++i) {
-            for (int j = 0; j < 3; ++j) {
-                m_polygons[i].vertices[j].x += x;
-                m_polygons[i].vertices[j].y += y;
-                m_polygons[i].vertices[j].z += z;
-            }
-        }
+    void push_back(const T &value) {
+        fresh();
+        if (m_size == m_capacity) grow(m_size + 1);
+        m_data[m_size++] = value;
     }
 
-    void rotate(float angle) {
-        for (int i = 0; i < m_count; ++i) {
-            for (int j = 0; j < 3; ++j) {
-                m_polygons[i].vertices[j] = rotate_y(angle, m_polygons[i].vertices[j]);
-            }
-        }
+    void resize(size_t size) {
+        fresh();
+        if (size > m_capacity) grow(size);
+        m_size = size;
     }
 
-    void rotate_around_point(float angle, Point3D origin) {
-        for (int i = 0; i < m_count; ++i) {
-            for (int j = 0; j < 3; ++j) {
-                m_polygons[i].vertices[j] = rotate_y_around_point(angle, m_polygons[i].vertices[j], origin);
-            }
-        }
+    void assign(size_t size, const T &value) {
+        resize(size);
+        std::fill(m_data, m_data + size, value);
     }
 
+    T *data() { return m_data; }
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    T &operator[](size_t i) { return m_data[i]; }
+    T *begin() { return m_data; }
+    T *end() { return m_data + m_size; }
+
 private:
-    Triangle *m_polygons;
-    int m_count;
+    T *m_data = nullptr;
+    size_t m_size = 0;
+    size_t m_capacity = 0;
+    unsigned m_generation = 0;
 
-    Vec3 parse_v3(std::istringstream &f) {
-        Vec3 v;
-        f >> v.x >> v.y >> v.z;
-        return v;
+    void fresh() {
+        if (m_generation != g_frame_arena.generation()) {
+            m_data = nullptr;
+            m_size = m_capacity = 0;
+            m_generation = g_frame_arena.generation();
+        }
+    }
+
+    void grow(size_t min_capacity) {
+        size_t capacity = std::max({ min_capacity, m_capacity * 2, (size_t) 64 });
+        T *data = g_frame_arena.alloc<T>(capacity);
+        if (m_size) memcpy(data, m_data, m_size * sizeof(T));
+        m_data = data;
+        m_capacity = capacity;
     }
 };
 
-struct Axes : Drawable {
+/******************** Profiler **********************************************/
 
-    Axes(float length) : m_length(length) { }
+struct Frame_stats {
+    /* counters of the frame being drawn, reset by draw_frame() */
+    long triangles = 0;
+    long draw_calls = 0;
+    long heap_allocations = 0;
+    long occluded = 0;         // objects, chunks and instances in view but hidden by occluders
+    long unoccluded = 0;       // the ones tested and not hidden
+    float render_scale = 1;    // of the window's width and height
+    float budget_headroom = 0; // share of the frame-time budget left over, negative when over it
+};
 
-    void draw_impl(SDL_Renderer *renderer, Player &player) {
-        
-        // draw in front of the player
-        Point3D pos = player.in_front();
+Frame_stats g_frame_stats;
 
-        Point2D offset = { 0.35f * screen_width, -0.35f * screen_height };
-        Point2D origin = { 0.5f * screen_width,  0.5f * screen_height };
-        origin += offset;
+#ifdef PROFILE
 
-        Point2D x = get_onscreen_point(pos + (Point3D) {m_length, 0, 0}, player) + offset;
-        Point2D y = get_onscreen_point(pos + (Point3D) {0, m_length, 0}, player) + offset;
-        Point2D z = get_onscreen_point(pos + (Point3D) {0, 0, m_length}, player) + offset;
+inline uint64_t profile_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
+struct Profiler {
+    /*
+     * Collects the timed scopes of PROFILE_SCOPE(). Every frame the time
+     * spent per scope name is folded into a rolling average for the
+     * overlay. While recording, all scopes are also kept for export as a
+     * Chrome trace-event JSON file (chrome://tracing, Perfetto).
+     */
 
-        SDL_SetRenderDrawColor(g_renderer, 0x31, 0x31, 0x31, 0xFF);
-#define RECT_SIZE (screen_height + screen_width) / 12
-        SDL_Rect axis_rect = { (int) (0.85f * screen_width) - RECT_SIZE / 2, (int) (0.15f * screen_height) - RECT_SIZE / 2, RECT_SIZE, RECT_SIZE};
-        SDL_RenderFillRect(g_renderer, &axis_rect);
-        SDL_SetRenderDrawColor(renderer, 0x00, 0xFF, 0x00, 0xFF);
+    void record(const char *name, uint64_t start_ns, uint64_t end_ns) {
+        Event e = { name, start_ns, end_ns - start_ns, thread_number() };
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_frame_events.push_back(e);
+        if (m_recording && m_trace.size() < MAX_TRACE_EVENTS) {
+            m_trace.push_back(e);
+        }
+    }
 
-        // draw x axis
-        SDL_RenderDrawLineF(renderer, origin.x, origin.y, x.x, x.y);
-        SDL_RenderDrawLineF(renderer, x.x - 10, x.y - 20, x.x + 10, x.y);
-        SDL_RenderDrawLineF(renderer, x.x - 10, x.y,      x.x + 10, x.y - 20);
+    void end_frame() {
+        /* fold this frame's scopes into the rolling averages */
+        uint64_t now = profile_now_ns();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto &stage: m_stages) stage.frame_ns = 0;
+        for (auto &e: m_frame_events) {
+            stage(e.name).frame_ns += e.duration_ns;
+        }
+        for (auto &stage: m_stages) {
+            stage.average_ms = stage.average_ms * (1 - SMOOTHING) + stage.frame_ns * 1e-6 * SMOOTHING;
+        }
+        if (m_frame_start) {
+            m_frame_ms = m_frame_ms * (1 - SMOOTHING) + (now - m_frame_start) * 1e-6 * SMOOTHING;
+        }
+        m_frame_start = now;
+        m_triangles = g_frame_stats.triangles;
+        m_draw_calls = g_frame_stats.draw_calls;
+        m_heap_allocations = g_frame_stats.heap_allocations;
+        m_occluded = g_frame_stats.occluded;
+        m_unoccluded = g_frame_stats.unoccluded;
+        m_render_scale = g_frame_stats.render_scale;
+        m_budget_headroom = g_frame_stats.budget_headroom;
+        m_frame_events.clear();
+    }
 
-        // draw y axis
-        SDL_RenderDrawLineF(renderer, origin.x, origin.y, y.x, y.y);
-        SDL_RenderDrawLineF(renderer, y.x + 15, y.y,      y.x + 15, y.y - 10);
-        SDL_RenderDrawLineF(renderer, y.x + 15, y.y - 10, y.x + 5,  y.y - 20);
-        SDL_RenderDrawLineF(renderer, y.x + 15, y.y - 10, y.x + 25, y.y - 20);
+    void draw_overlay(SDL_Renderer *renderer) {
+        const int line = 14, left = 10, bar_left = 170, width = 330;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        SDL_Rect background = { left - 5, 5, width, (int) (m_stages.size() + 6) * line + 10 };
+        SDL_SetRenderDrawColor(renderer, 0x10, 0x10, 0x10, 0xFF);
+        SDL_RenderFillRect(renderer, &background);
 
-        //draw z axis
-        SDL_RenderDrawLineF(renderer, origin.x, origin.y, z.x, z.y);
-        SDL_RenderDrawLineF(renderer, z.x - 10, z.y - 25, z.x + 10, z.y - 25);
-        SDL_RenderDrawLineF(renderer, z.x + 10, z.y - 25, z.x - 10, z.y - 5);
-        SDL_RenderDrawLineF(renderer, z.x - 10, z.y - 5,  z.x + 10, z.y - 5);
-        
+        char text[128];
+        int y = 10;
+        SDL_SetRenderDrawColor(renderer, UNHEX(COLOR_BEIGE));
+        snprintf(text, sizeof text, "frame %.2f ms (%.0f fps)", m_frame_ms, m_frame_ms > 0 ? 1000 / m_frame_ms : 0.0);
+        draw_debug_text(renderer, left, y, text);
+        y += line;
+        snprintf(text, sizeof text, "triangles %ld  draw calls %ld", m_triangles, m_draw_calls);
+        draw_debug_text(renderer, left, y, text);
+        y += line;
+        snprintf(text, sizeof text, "heap allocs %ld  arena %zu kb", m_heap_allocations, g_frame_arena.used() / 1024);
+        draw_debug_text(renderer, left, y, text);
+        y += line;
+        snprintf(text, sizeof text, "render scale %.0f%%  headroom %+.0f%%", m_render_scale * 100, m_budget_headroom * 100);
+        draw_debug_text(renderer, left, y, text);
+        y += line;
+        snprintf(text, sizeof text, "occluded %ld  visible %ld", m_occluded, m_unoccluded);
+        draw_debug_text(renderer, left, y, text);
+        y += line;
+        snprintf(text, sizeof text, "%s", m_recording ? "recording trace (f4)" : "f4: record trace");
+        draw_debug_text(renderer, left, y, text);
+        y += line;
+
+        for (auto &stage: m_stages) {
+            SDL_SetRenderDrawColor(renderer, UNHEX(COLOR_BEIGE));
+            snprintf(text, sizeof text, "%-14s %6.2f", stage.name, stage.average_ms);
+            draw_debug_text(renderer, left, y, text);
+            // bar scaled so a full 60 fps frame spans the overlay
+            int bar = std::min(stage.average_ms / (1000.0 / 60), 1.0) * (width - bar_left);
+            SDL_Rect rect = { bar_left, y, std::max(bar, 1), 10 };
+            SDL_SetRenderDrawColor(renderer, UNHEX(COLOR_GREEN));
+            SDL_RenderFillRect(renderer, &rect);
+            y += line;
+        }
+    }
 
+    void toggle_recording() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_recording = !m_recording;
+        if (m_recording) {
+            m_trace.clear();
+            SDL_Log("Recording trace");
+        } else {
+            write_trace(TRACE_FILE);
+        }
     }
 
+    bool overlay = false;
+
 private:
-    float m_length;
-};
+    struct Event {
+        const char *name;
+        uint64_t start_ns;
+        uint64_t duration_ns;
+        int thread;
+    };
 
-//TODO: rewrite everything in terms of matrices to be able to transform meshes in any way
-struct Space_ship : Drawable {
+    struct Stage {
+        const char *name;
+        uint64_t frame_ns;
+        double average_ms;
+    };
 
-    void move_forward(float d) {
-        m_pos.z += std::cos(m_angle) * d;
-        m_pos.x += std::sin(m_angle) * d;
+    static constexpr double SMOOTHING = 0.05;
+    static constexpr size_t MAX_TRACE_EVENTS = 1 << 20;
+    static constexpr const char *TRACE_FILE = "ddd_trace.json";
+
+    std::mutex m_mutex;
+    std::vector<Event> m_frame_events;
+    std::vector<Event> m_trace;
+    std::vector<Stage> m_stages;
+    bool m_recording = false;
+    uint64_t m_frame_start = 0;
+    double m_frame_ms = 0;
+    long m_triangles = 0;
+    long m_draw_calls = 0;
+    long m_heap_allocations = 0;
+    long m_occluded = 0;
+    long m_unoccluded = 0;
+    float m_render_scale = 1;
+    float m_budget_headroom = 0;
+
+    static int thread_number() {
+        static std::atomic<int> next_thread{0};
+        thread_local int number = next_thread++;
+        return number;
     }
 
-    void rotate(float angle) {
-        m_angle += angle;
+    Stage &stage(const char *name) {
+        for (auto &s: m_stages) {
+            if (s.name == name || strcmp(s.name, name) == 0) return s;
+        }
+        m_stages.push_back({ name, 0, 0 });
+        return m_stages.back();
     }
 
-    void draw_impl(SDL_Renderer *renderer, Player &player) {
-        m_mesh.draw_impl(renderer, player);
+    void write_trace(const char *path) {
+        FILE *f = fopen(path, "w");
+        if (!f) {
+            SDL_Log("Error: could not write %s", path);
+            return;
+        }
+        fprintf(f, "{\"traceEvents\": [\n");
+        for (size_t i = 0; i < m_trace.size(); ++i) {
+            const Event &e = m_trace[i];
+            fprintf(f, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}%s\n",
+                    e.name, e.thread, e.start_ns * 1e-3, e.duration_ns * 1e-3, i + 1 < m_trace.size() ? "," : "");
+        }
+        fprintf(f, "]}\n");
+        fclose(f);
+        SDL_Log("Wrote %zu trace events to %s", m_trace.size(), path);
     }
+};
+
+Profiler g_profiler;
 
+struct Profile_scope {
+    Profile_scope(const char *name) : m_name(name), m_start(profile_now_ns()) { }
+    ~Profile_scope() { g_profiler.record(m_name, m_start, profile_now_ns()); }
 private:
-    Point3D m_pos;
-    Mesh m_mesh;
-    float m_angle;
+    const char *m_name;
+    uint64_t m_start;
 };
 
-int main () {
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+// times the rest of the enclosing block, name must be a string with static lifetime
+#define PROFILE_SCOPE(name) Profile_scope PROFILE_CONCAT(profile_scope_, __LINE__)(name)
 
-    bool quit;
-    init();
-    SDL_Event event;
+#else
 
-    Player player(0, -.7, 0);
-    int input_timer_start = SDL_GetTicks();
+#define PROFILE_SCOPE(name)
 
-    std::vector<Drawable *> drawing_list;
+#endif
 
-    Axes axes(0.1);
-    drawing_list.push_back(&axes);
-    
-    Mesh mesh("ship.obj");
-    float ship_angle = 0;
-    mesh.translate(0, 0, -25.0);
-    mesh.rotate_around_point(-M_PI / 2.0f, {0.0f, 0.0f, -25.0f});
-    drawing_list.push_back(&mesh);
+/******************** Thread pool *******************************************/
 
-    while (!quit) {
-        while(SDL_PollEvent(&event) != 0) {
-            switch (event.type) {
-                case SDL_QUIT:
-                    quit = true;
-                    break;
-                case SDL_WINDOWEVENT:
-                    if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
-                        screen_width = event.window.data1;
-                        screen_height = event.window.data2;
-                    }
-                    break;
-                case SDL_MOUSEMOTION:
-                    player.m_vertical_view_angle   = std::clamp(player.m_vertical_view_angle + (double) event.motion.yrel / 400, -M_PI / 2, M_PI / 2); // can only look 90 degrees up
-                    player.m_horizontal_view_angle = player.m_horizontal_view_angle + (double) event.motion.xrel / 400;
-                    break;
-                case SDL_MOUSEBUTTONDOWN:
-                    if (event.button.button == SDL_BUTTON_LEFT) {
-                        drawing_list.push_back(new Cube(round(player.in_front(1.2f), 0.5f), 0.5f, COLOR_RED));
-                    } else if (event.button.button == SDL_BUTTON_RIGHT) {
-                        drawing_list.push_back(new Cube(round(player.in_front(1.2f), 0.5f), 0.5f, COLOR_GREEN));
-                    }
-                case SDL_KEYDOWN:
-                    if (event.key.keysym.scancode == SDL_SCANCODE_F1) {
-                        axes.switch_activation();
-                    }
-            }
+struct Thread_pool {
+    /* fixed set of worker threads consuming a shared FIFO of tasks */
+
+    Thread_pool(unsigned thread_count = std::max(1u, std::thread::hardware_concurrency())) {
+        for (unsigned i = 0; i < thread_count; ++i) {
+            m_workers.emplace_back([this] { work(); });
         }
+    }
 
-        if (SDL_GetTicks() - input_timer_start > 1000 / 30) {
-            input_timer_start = SDL_GetTicks();
-            const Uint8* key_state = SDL_GetKeyboardState(NULL);
-            const SDL_Keymod mod_state = SDL_GetModState();
-            if (key_state[SDL_SCANCODE_D]) {
-                player.move_right(0.1);
-            }
-            if (key_state[SDL_SCANCODE_A]) {
-                player.move_left(0.1);
-            }
-            if (key_state[SDL_SCANCODE_W]) {
-                player.move_forward(0.1);
-            }
-            if (key_state[SDL_SCANCODE_S]) {
-                player.move_backward(0.1);
-            }
-            if (mod_state & KMOD_CTRL) {
-                player.move_y(0.1);
-            }
-            if (key_state[SDL_SCANCODE_SPACE]) {
-                player.move_y(-0.1);
-            }
+    ~Thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
         }
+        m_wake.notify_all();
+        for (auto &t: m_workers) t.join();
+    }
 
-        SDL_SetRenderDrawColor(g_renderer, 0x00, 0x00, 0x00, 0xFF);
-        SDL_RenderClear(g_renderer);
+    Thread_pool(const Thread_pool &) = delete;
+    Thread_pool &operator=(const Thread_pool &) = delete;
 
-        /***************** Drawing *******************************/
+    template <typename F>
+    auto submit(F task) -> std::future<decltype(task())> {
+        auto packaged = std::make_shared<std::packaged_task<decltype(task())()>>(std::move(task));
+        auto result = packaged->get_future();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_tasks.emplace_back([packaged] { (*packaged)(); });
+        }
+        m_wake.notify_one();
+        return result;
+    }
 
-        mesh.rotate(ship_angle+=0.000001);
+    void parallel_for(int count, const std::function<void(int)> &body) {
+        /* runs body(0) .. body(count - 1) on the workers and waits for all of them */
+        std::vector<std::future<void>> done;
+        done.reserve(count);
+        for (int i = 0; i < count; ++i) {
+            done.push_back(submit([&body, i] { body(i); }));
+        }
+        for (auto &f: done) f.get();
+    }
 
-        for (auto i: drawing_list) {
-            i->draw(g_renderer, player);
+    void parallel_claim(int count, const std::function<void(int)> &body, int max_threads = 0) {
+        /*
+         * Runs body(0) .. body(count - 1) on the calling thread and on
+         * whichever workers are idle, every one of them claiming the next
+         * index as soon as it is done with its last, so uneven items
+         * balance out. Workers busy with a long task simply do not join.
+         * Unlike parallel_for() this allocates nothing. max_threads limits
+         * the participants, counting the caller, 0 for no limit.
+         */
+        std::lock_guard<std::mutex> one_at_a_time(m_claim_mutex);
+        m_claim_next = 0;
+        m_claim_count = count;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_claim_body = &body;
+            m_claim_slots = max_threads > 0 ? max_threads - 1 : size();
+            ++m_claim_generation;
         }
+        if (count > 1 && max_threads != 1) m_wake.notify_all();
 
-        //cross
-        SDL_SetRenderDrawColor(g_renderer, UNHEX(COLOR_BEIGE));
-        SDL_RenderDrawLine(g_renderer, screen_width / 2, screen_height / 2 - 10, screen_width / 2, screen_height / 2 + 10);
-        SDL_RenderDrawLine(g_renderer, screen_width / 2 - 10, screen_height / 2, screen_width / 2 + 10, screen_height / 2);
+        claim(body);
 
-        /*********************************************************/
+        // no one joins any more, wait for those that did
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_claim_body = nullptr;
+        m_claim_done.wait(lock, [this] { return m_claim_workers == 0; });
+    }
 
+    int size() const {
+        return m_workers.size();
+    }
+
+private:
+    void work() {
+        int seen_generation = 0;
+        for (;;) {
+            std::function<void()> task;
+            const std::function<void(int)> *body = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                auto claimable = [&] { return m_claim_body && m_claim_slots > 0 && m_claim_generation != seen_generation; };
+                m_wake.wait(lock, [&] { return m_stopping || !m_tasks.empty() || claimable(); });
+                if (claimable()) {
+                    seen_generation = m_claim_generation;
+                    body = m_claim_body;
+                    --m_claim_slots;
+                    ++m_claim_workers;
+                } else {
+                    if (m_stopping && m_tasks.empty()) return;
+                    task = std::move(m_tasks.front());
+                    m_tasks.pop_front();
+                }
+            }
+            if (body) {
+                claim(*body);
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (--m_claim_workers == 0) m_claim_done.notify_all();
+            } else {
+                task();
+            }
+        }
+    }
+
+    void claim(const std::function<void(int)> &body) {
+        for (int i; (i = m_claim_next.fetch_add(1, std::memory_order_relaxed)) < m_claim_count;) {
+            body(i);
+        }
+    }
+
+    std::vector<std::thread> m_workers;
+    std::deque<std::function<void()>> m_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    bool m_stopping = false;
+
+    // parallel_claim() state, the body pointer is only set while workers may join
+    std::mutex m_claim_mutex;
+    std::condition_variable m_claim_done;
+    const std::function<void(int)> *m_claim_body = nullptr;
+    int m_claim_generation = 0;
+    int m_claim_slots = 0;
+    int m_claim_workers = 0;
+    int m_claim_count = 0;
+    std::atomic<int> m_claim_next{0};
+};
+
+Thread_pool &worker_pool() {
+    static Thread_pool pool;
+    return pool;
+}
+
+Thread_pool &loader_pool() {
+    /*
+     * asset loads, which wait on worker_pool() tasks themselves and so
+     * must not run on it; created after worker_pool() so it is destroyed,
+     * finishing its loads, before the workers go away
+     */
+    worker_pool();
+    static Thread_pool pool(2);
+    return pool;
+}
+
+/******************** Software rasterizer ***********************************/
+
+enum Render_backend {
+    BACKEND_SDL,      // SDL_Renderer geometry, painter's algorithm
+    BACKEND_SOFTWARE, // CPU rasterization with a depth buffer, uploaded as a texture
+};
+
+const char *backend_name(Render_backend backend) {
+    switch (backend) {
+        case BACKEND_SDL:      return "SDL_Renderer";
+        case BACKEND_SOFTWARE: return "software";
+    }
+    return "unknown";
+}
+
+Render_backend g_backend = BACKEND_SDL;
+
+inline uint32_t rgba(uint8_t r, uint8_t g, uint8_t b, uint8_t a = 0xFF) {
+    return (uint32_t) r << 3 * 8 | (uint32_t) g << 2 * 8 | (uint32_t) b << 8 | a;
+}
+
+inline float inverse_depth(float z) {
+    /* same near clamp as project() */
+    return 1.0f / std::max(z, 0.1f);
+}
+
+#define TILE_SIZE 64
+
+// threads rasterizing tiles, counting the render thread, 0 for all of them
+int g_raster_threads = 0;
+
+struct Rasterizer {
+    /*
+     * Renders into a CPU framebuffer with a per-pixel depth buffer.
+     * Vertices are given in screen space: x and y in pixels, z is the
+     * inverse camera depth (1 / z), which is linear in screen space, so
+     * a bigger value is nearer and the buffer is cleared to 0.
+     *
+     * Triangles and lines are only recorded when submitted. flush() bins
+     * them into TILE_SIZE tiles and rasterizes the tiles in parallel, each
+     * replaying its commands in submission order, so every pixel sees
+     * exactly the same operations no matter how many threads take part.
+     *
+     * Anything drawn straight through SDL_Renderer (HUD, crosshair) has to
+     * come after flush(), which copies the framebuffer onto the renderer.
+     */
+
+    void begin_frame(SDL_Renderer *renderer, int width, int height) {
+        if (width != m_width || height != m_height) {
+            m_width = width;
+            m_height = height;
+            m_color.assign((size_t) width * height, 0);
+            m_depth.assign((size_t) width * height, 0.0f);
+        }
+        // the texture only grows, so a changing render scale does not recreate it every frame
+        if (width > 0 && height > 0 && (width > m_texture_width || height > m_texture_height)) {
+            if (m_texture) SDL_DestroyTexture(m_texture);
+            m_texture_width = std::max(width, m_texture_width);
+            m_texture_height = std::max(height, m_texture_height);
+            scp((m_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, m_texture_width, m_texture_height)),
+                    "Could not create framebuffer texture");
+            // transparent pixels let previous flushes and SDL drawing show through
+            SDL_SetTextureBlendMode(m_texture, SDL_BLENDMODE_BLEND);
+        }
+        std::fill(m_color.begin(), m_color.end(), 0);
+        std::fill(m_depth.begin(), m_depth.end(), 0.0f);
+        m_commands.clear();
+    }
+
+    void fill_triangle(Vec3 a, Vec3 b, Vec3 c, uint32_t color) {
+        m_commands.push_back({ { a, b, c }, color, false });
+    }
+
+    void draw_line(Vec3 a, Vec3 b, uint32_t color) {
+        m_commands.push_back({ { a, b, b }, color, true });
+    }
+
+    void flush(SDL_Renderer *renderer) {
+        /* rasterize and copy everything submitted so far onto the renderer, keeping the depth buffer */
+        if (m_commands.empty() || !m_width || !m_height) return;
+        {
+            PROFILE_SCOPE("bin");
+            bin();
+        }
+        {
+            PROFILE_SCOPE("raster");
+            worker_pool().parallel_claim(m_tile_count, m_raster_tile, g_raster_threads);
+        }
+        SDL_Rect rect = { 0, 0, m_width, m_height };
+        SDL_UpdateTexture(m_texture, &rect, m_color.data(), m_width * sizeof(uint32_t));
+        SDL_RenderCopy(renderer, m_texture, &rect, nullptr);
+        std::fill(m_color.begin(), m_color.end(), 0);
+        m_commands.clear();
+    }
+
+private:
+    struct Command {
+        Vec3 v[3];
+        uint32_t color;
+        bool line;
+    };
+
+    struct Tile_rect {
+        int min_x, min_y, max_x, max_y; // inclusive pixel bounds
+    };
+
+    static float edge(const Vec3 &a, const Vec3 &b, float x, float y) {
+        return (b.x - a.x) * (y - a.y) - (b.y - a.y) * (x - a.x);
+    }
+
+    int m_width = 0;
+    int m_height = 0;
+    std::vector<uint32_t> m_color;
+    std::vector<float> m_depth;
+    SDL_Texture *m_texture = nullptr;
+    int m_texture_width = 0;
+    int m_texture_height = 0;
+
+    // per-frame command list and tile bins, in the frame arena
+    Frame_array<Command> m_commands;
+    Frame_array<Tile_rect> m_command_tiles;  // tiles touched by each command
+    Frame_array<int> m_bin_start;            // tile t's commands are m_bins[m_bin_start[t] .. m_bin_start[t + 1]]
+    Frame_array<int> m_bins;
+    Frame_array<int> m_tile_order;           // busiest tiles first
+    int m_tiles_x = 0;
+    int m_tile_count = 0;
+    const std::function<void(int)> m_raster_tile = [this](int i) { raster_tile(m_tile_order[i]); };
+
+    void bin() {
+        /* counting sort of the commands into the tiles their bounding boxes touch, keeping submission order */
+        m_tiles_x = (m_width + TILE_SIZE - 1) / TILE_SIZE;
+        int tiles_y = (m_height + TILE_SIZE - 1) / TILE_SIZE;
+        m_tile_count = m_tiles_x * tiles_y;
+        int count = m_commands.size();
+        m_command_tiles.resize(count);
+        m_bin_start.assign(m_tile_count + 1, 0);
+
+        for (int i = 0; i < count; ++i) {
+            const Command &c = m_commands[i];
+            int n = c.line ? 2 : 3;
+            float min_x = c.v[0].x, max_x = c.v[0].x, min_y = c.v[0].y, max_y = c.v[0].y;
+            for (int j = 1; j < n; ++j) {
+                min_x = std::min(min_x, c.v[j].x);
+                max_x = std::max(max_x, c.v[j].x);
+                min_y = std::min(min_y, c.v[j].y);
+                max_y = std::max(max_y, c.v[j].y);
+            }
+            // same pixel bounds as the rasterizers, empty if off screen
+            Tile_rect &r = m_command_tiles[i];
+            r.min_x = std::max(0,            (int) std::floor(min_x)) / TILE_SIZE;
+            r.max_x = std::min(m_width - 1,  (int) std::ceil (max_x)) / TILE_SIZE;
+            r.min_y = std::max(0,            (int) std::floor(min_y)) / TILE_SIZE;
+            r.max_y = std::min(m_height - 1, (int) std::ceil (max_y)) / TILE_SIZE;
+            if (max_x < 0 || max_y < 0) r.max_x = -1;
+            for (int ty = r.min_y; ty <= r.max_y; ++ty) {
+                for (int tx = r.min_x; tx <= r.max_x; ++tx) ++m_bin_start[ty * m_tiles_x + tx + 1];
+            }
+        }
+        for (int t = 0; t < m_tile_count; ++t) m_bin_start[t + 1] += m_bin_start[t];
+
+        m_bins.resize(m_bin_start[m_tile_count]);
+        Frame_array<int> &fill = m_tile_order; // borrowed as the write cursors
+        fill.resize(m_tile_count);
+        for (int t = 0; t < m_tile_count; ++t) fill[t] = m_bin_start[t];
+        for (int i = 0; i < count; ++i) {
+            const Tile_rect &r = m_command_tiles[i];
+            for (int ty = r.min_y; ty <= r.max_y; ++ty) {
+                for (int tx = r.min_x; tx <= r.max_x; ++tx) m_bins[fill[ty * m_tiles_x + tx]++] = i;
+            }
+        }
+
+        for (int t = 0; t < m_tile_count; ++t) m_tile_order[t] = t;
+        std::sort(m_tile_order.begin(), m_tile_order.end(), [this](int a, int b) {
+            return m_bin_start[a + 1] - m_bin_start[a] > m_bin_start[b + 1] - m_bin_start[b];
+        });
+    }
+
+    void raster_tile(int tile) {
+        int tx = tile % m_tiles_x, ty = tile / m_tiles_x;
+        Tile_rect rect = { tx * TILE_SIZE, ty * TILE_SIZE,
+                           std::min(m_width, (tx + 1) * TILE_SIZE) - 1, std::min(m_height, (ty + 1) * TILE_SIZE) - 1 };
+        for (int i = m_bin_start[tile]; i < m_bin_start[tile + 1]; ++i) {
+            const Command &c = m_commands[m_bins[i]];
+            if (c.line) {
+                raster_line(c.v[0], c.v[1], c.color, rect);
+            } else {
+                raster_triangle(c.v[0], c.v[1], c.v[2], c.color, rect);
+            }
+        }
+    }
+
+    void raster_triangle(Vec3 a, Vec3 b, Vec3 c, uint32_t color, const Tile_rect &tile) {
+        float area = edge(a, b, c.x, c.y);
+        if (area == 0) return;
+        if (area < 0) {
+            std::swap(b, c);
+            area = -area;
+        }
+
+        int min_x = std::max(tile.min_x, (int) std::floor(std::min({a.x, b.x, c.x})));
+        int max_x = std::min(tile.max_x, (int) std::ceil (std::max({a.x, b.x, c.x})));
+        int min_y = std::max(tile.min_y, (int) std::floor(std::min({a.y, b.y, c.y})));
+        int max_y = std::min(tile.max_y, (int) std::ceil (std::max({a.y, b.y, c.y})));
+        if (min_x > max_x || min_y > max_y) return;
+
+        // edge functions are affine in x, so step them instead of re-evaluating per pixel
+        float dx0 = b.y - c.y, dx1 = c.y - a.y, dx2 = a.y - b.y;
+        float inv_area = 1.0f / area;
+
+        for (int y = min_y; y <= max_y; ++y) {
+            float px = min_x + 0.5f, py = y + 0.5f;
+            float w0 = edge(b, c, px, py);
+            float w1 = edge(c, a, px, py);
+            float w2 = edge(a, b, px, py);
+            size_t row = (size_t) y * m_width;
+            for (int x = min_x; x <= max_x; ++x, w0 += dx0, w1 += dx1, w2 += dx2) {
+                if (w0 < 0 || w1 < 0 || w2 < 0) continue;
+                float depth = (w0 * a.z + w1 * b.z + w2 * c.z) * inv_area;
+                if (depth > m_depth[row + x]) {
+                    m_depth[row + x] = depth;
+                    m_color[row + x] = color;
+                }
+            }
+        }
+    }
+
+    void raster_line(Vec3 a, Vec3 b, uint32_t color, const Tile_rect &tile) {
+        int steps = (int) std::ceil(std::max(std::fabs(b.x - a.x), std::fabs(b.y - a.y)));
+        float inv_steps = steps ? 1.0f / steps : 0.0f;
+        for (int i = 0; i <= steps; ++i) {
+            float t = i * inv_steps;
+            int x = (int) (a.x + (b.x - a.x) * t);
+            int y = (int) (a.y + (b.y - a.y) * t);
+            if (x < tile.min_x || y < tile.min_y || x > tile.max_x || y > tile.max_y) continue;
+            float depth = a.z + (b.z - a.z) * t;
+            size_t i_px = (size_t) y * m_width + x;
+            // lines win ties so edges lying on a surface stay visible
+            if (depth >= m_depth[i_px]) {
+                m_depth[i_px] = depth;
+                m_color[i_px] = color;
+            }
+        }
+    }
+};
+
+Rasterizer g_rasterizer;
+
+/******************** Line submission ***************************************/
+
+struct Line_batch {
+    /*
+     * Wireframe segments in screen space with a color each, collected
+     * across drawables and drawn as one pixel wide quads with a single
+     * SDL_RenderGeometry call. Whatever else draws with the SDL renderer
+     * flushes the batch first, so the painter's order is kept while runs
+     * of wireframes still go out together.
+     */
+
+    void add(Point2D a, Point2D b, uint32_t color) {
+        SDL_Color c = { (uint8_t) (color >> 3 * 8), (uint8_t) (color >> 2 * 8), (uint8_t) (color >> 8), (uint8_t) color };
+        float dx = b.x - a.x, dy = b.y - a.y;
+        float length = sqrtf(dx * dx + dy * dy);
+        // half a pixel across the segment and past both ends
+        float ux = length > 0 ? dx / length * 0.5f : 0.5f, uy = length > 0 ? dy / length * 0.5f : 0.0f;
+        int first = m_vertex_buffer.size();
+        m_vertex_buffer.push_back({ { a.x - ux + uy, a.y - uy - ux }, c, { 0, 0 } });
+        m_vertex_buffer.push_back({ { a.x - ux - uy, a.y - uy + ux }, c, { 0, 0 } });
+        m_vertex_buffer.push_back({ { b.x + ux - uy, b.y + uy + ux }, c, { 0, 0 } });
+        m_vertex_buffer.push_back({ { b.x + ux + uy, b.y + uy - ux }, c, { 0, 0 } });
+        for (int i: { 0, 1, 2, 0, 2, 3 }) m_index_buffer.push_back(first + i);
+    }
+
+    void flush(SDL_Renderer *renderer) {
+        if (m_vertex_buffer.empty()) return;
+        SDL_RenderGeometry(renderer, nullptr, m_vertex_buffer.data(), m_vertex_buffer.size(), m_index_buffer.data(), m_index_buffer.size());
+        ++g_frame_stats.draw_calls;
+        m_vertex_buffer.clear();
+        m_index_buffer.clear();
+    }
+
+private:
+    Frame_array<SDL_Vertex> m_vertex_buffer;
+    Frame_array<int> m_index_buffer;
+};
+
+Line_batch g_line_batch;
+
+/******************** Triangle submission ***********************************/
+
+// reuse the previous frame's triangle order as the starting point of the depth sort
+bool g_temporal_sort = true;
+
+inline uint32_t descending_key(float f) {
+    /* maps a float to an unsigned key that sorts in descending float order */
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof bits);
+    uint32_t ascending = bits & 0x80000000 ? ~bits : bits | 0x80000000;
+    return ~ascending;
+}
+
+struct Triangle_batch {
+    /*
+     * Collects flat-shaded camera-space triangles for one draw call.
+     * Triangles crossing a clipping plane are clipped first. With the
+     * software backend they go straight to the rasterizer, otherwise they
+     * are depth sorted (painter's algorithm) by draw() and submitted in a
+     * single indexed SDL_RenderGeometry call. The per-frame buffers live in
+     * the frame arena.
+     */
+
+    void clear() {
+        m_vertex_buffer.clear();
+        m_depth_keys.clear();
+        m_ids.clear();
+    }
+
+    void add(Point3D *poly, const Point2D *projected, int crossed, SDL_Color color, const Plane *planes, int64_t id) {
+        /*
+         * poly      - the 3 camera-space vertices, with room for MAX_CLIPPED_VERTICES
+         * projected - their screen positions if already known and crossed == 0, or nullptr
+         * crossed   - mask of the clipping planes the triangle has vertices outside of
+         * id        - non-negative number identifying the triangle from frame to frame,
+         *             only used to speed up sorting
+         */
+        float depth_key = poly[0].z + poly[1].z + poly[2].z;
+        Point2D pts[MAX_CLIPPED_VERTICES];
+        int count = 3;
+        if (crossed) {
+            count = clip_polygon(poly, 3, crossed, planes);
+        }
+        for (int j = 0; j < count; ++j) {
+            pts[j] = projected && !crossed ? projected[j] : place_projected_point(project(poly[j]));
+        }
+
+        // a clipped triangle is a convex polygon, drawn as a fan
+        for (int k = 1; k + 1 < count; ++k) {
+            int fan[3] = { 0, k, k + 1 };
+            if (g_backend == BACKEND_SOFTWARE) {
+                Vec3 v[3];
+                for (int j = 0; j < 3; ++j) {
+                    v[j] = { pts[fan[j]].x, pts[fan[j]].y, inverse_depth(poly[fan[j]].z) };
+                }
+                g_rasterizer.fill_triangle(v[0], v[1], v[2], rgba(color.r, color.g, color.b, color.a));
+                continue;
+            }
+
+            // flat shading: every triangle gets its own three vertices
+            for (int j = 0; j < 3; ++j) {
+                m_vertex_buffer.push_back({ pts[fan[j]], color, SDL_FPoint{ 0 } });
+            }
+            m_depth_keys.push_back(depth_key);
+            m_ids.push_back(id);
+        }
+        g_frame_stats.triangles += std::max(count - 2, 0);
+    }
+
+    void draw(SDL_Renderer *renderer) {
+        if (m_depth_keys.empty()) return;
+
+        // wireframes queued so far lie below these triangles
+        g_line_batch.flush(renderer);
+
+        //sort by z: the index buffer is written back to front, the vertices stay in place
+        sort();
+
+        int visible = m_depth_keys.size();
+        m_index_buffer.resize(visible * 3);
+        for (int i = 0; i < visible; ++i) {
+            int t = (uint32_t) m_sorted[i];
+            for (int j = 0; j < 3; ++j) {
+                m_index_buffer[i * 3 + j] = t * 3 + j;
+            }
+        }
+
+        PROFILE_SCOPE("submit");
+        SDL_RenderGeometry(renderer, nullptr, m_vertex_buffer.data(), m_vertex_buffer.size(), m_index_buffer.data(), m_index_buffer.size());
+        ++g_frame_stats.draw_calls;
+    }
+
+private:
+    // per-frame buffers in the frame arena
+    Frame_array<SDL_Vertex> m_vertex_buffer;
+    Frame_array<int> m_index_buffer;
+    Frame_array<float> m_depth_keys;
+    Frame_array<int64_t> m_ids;
+    // (descending depth key << 32 | triangle) pairs in draw order
+    Frame_array<uint64_t> m_sorted;
+    Frame_array<uint64_t> m_radix_scratch;
+
+    struct Id_slot {
+        int64_t id;  // -1 for an empty slot
+        int first;   // this frame's first triangle with the id, -1 once it is laid out
+    };
+    // open addressing hash of this frame's ids, sized by the triangles rather than the ids
+    Frame_array<Id_slot> m_first_of_id;
+    size_t m_id_mask = 0;
+
+    // ids in last frame's draw order, kept across frames for the temporal sort
+    std::vector<int64_t> m_previous_ids;
+
+    void sort() {
+        PROFILE_SCOPE("sort");
+        int visible = m_depth_keys.size();
+        m_sorted.resize(visible);
+        if (!g_temporal_sort || !seed_from_previous() || !insertion_sort(visible * 8)) {
+            for (int i = 0; i < visible; ++i) {
+                m_sorted[i] = (uint64_t) descending_key(m_depth_keys[i]) << 32 | (uint32_t) i;
+            }
+            radix_sort();
+        }
+        m_previous_ids.resize(visible);
+        for (int i = 0; i < visible; ++i) {
+            m_previous_ids[i] = m_ids[(uint32_t) m_sorted[i]];
+        }
+    }
+
+    bool seed_from_previous() {
+        /*
+         * Lays the triangles out in last frame's order: triangles of an id
+         * are consecutive (pieces of a clipped triangle), so every id only
+         * needs its first triangle. New triangles go at the end.
+         */
+        if (m_previous_ids.empty()) return false;
+        int visible = m_depth_keys.size();
+        size_t capacity = 64;
+        while (capacity < 2 * (size_t) visible) capacity *= 2;
+        m_id_mask = capacity - 1;
+        m_first_of_id.assign(capacity, { -1, -1 });
+        for (int i = visible - 1; i >= 0; --i) {
+            *find_id(m_ids[i]) = { m_ids[i], i };
+        }
+
+        int n = 0;
+        auto take = [&](Id_slot &slot) {
+            for (int t = slot.first; t < visible && m_ids[t] == slot.id; ++t) {
+                m_sorted[n++] = (uint64_t) descending_key(m_depth_keys[t]) << 32 | (uint32_t) t;
+            }
+            slot.first = -1;
+        };
+        for (int64_t id: m_previous_ids) {
+            Id_slot *slot = find_id(id);
+            if (slot->id == id && slot->first >= 0) take(*slot);
+        }
+        for (int i = 0; i < visible; ++i) {
+            Id_slot *slot = find_id(m_ids[i]);
+            if (slot->first == i) take(*slot);
+        }
+        return true;
+    }
+
+    Id_slot *find_id(int64_t id) {
+        /* the slot holding id, or the empty one it would go in */
+        size_t i = (size_t) ((uint64_t) id * 0x9E3779B97F4A7C15ull >> 32) & m_id_mask;
+        while (m_first_of_id[i].id != id && m_first_of_id[i].id >= 0) i = (i + 1) & m_id_mask;
+        return &m_first_of_id[i];
+    }
+
+    bool insertion_sort(long budget) {
+        /* finishes a nearly sorted order; gives up once more than budget moves were needed */
+        int visible = m_sorted.size();
+        for (int i = 1; i < visible; ++i) {
+            uint64_t item = m_sorted[i];
+            int j = i;
+            while (j > 0 && m_sorted[j - 1] >> 32 > item >> 32) {
+                m_sorted[j] = m_sorted[j - 1];
+                --j;
+                if (--budget < 0) return false;
+            }
+            m_sorted[j] = item;
+        }
+        return true;
+    }
+
+    void radix_sort() {
+        /* LSD radix sort of m_sorted by its upper 32 bits, 11 bits per pass, stable */
+        const int bits = 11, buckets = 1 << bits;
+        int visible = m_sorted.size();
+        m_radix_scratch.resize(visible);
+        uint64_t *from = m_sorted.data(), *to = m_radix_scratch.data();
+        for (int shift = 32; shift < 64; shift += bits) {
+            int count[buckets] = {};
+            for (int i = 0; i < visible; ++i) {
+                ++count[from[i] >> shift & (buckets - 1)];
+            }
+            // all keys share this digit, nothing to reorder
+            if (count[from[0] >> shift & (buckets - 1)] == visible) continue;
+            int offset = 0;
+            for (int b = 0; b < buckets; ++b) {
+                int c = count[b];
+                count[b] = offset;
+                offset += c;
+            }
+            for (int i = 0; i < visible; ++i) {
+                to[count[from[i] >> shift & (buckets - 1)]++] = from[i];
+            }
+            std::swap(from, to);
+        }
+        if (from != m_sorted.data()) {
+            std::copy(from, from + visible, m_sorted.data());
+        }
+    }
+};
+
+/******************** OBJ loading *******************************************/
+
+struct Mapped_file {
+    /* read-only memory mapping of a whole file */
+
+    Mapped_file(const std::string &path, bool sequential = true) {
+        /* sequential tells the kernel to read ahead, otherwise pages are prefetched in any order */
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            m_size = st.st_size;
+            m_ok = true;
+            if (m_size > 0) {
+                void *p = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+                if (p == MAP_FAILED) {
+                    m_ok = false;
+                    m_size = 0;
+                } else {
+                    m_data = (char *) p;
+                    madvise(p, m_size, sequential ? MADV_SEQUENTIAL : MADV_WILLNEED);
+                }
+            }
+        }
+        close(fd);
+    }
+
+    ~Mapped_file() {
+        if (m_data) munmap((void *) m_data, m_size);
+    }
+
+    Mapped_file(const Mapped_file &) = delete;
+    Mapped_file &operator=(const Mapped_file &) = delete;
+
+    bool is_open() const { return m_ok; }
+    const char *data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+    bool m_ok = false;
+};
+
+struct Obj_parser {
+    /*
+     * Parses the geometry of a Wavefront OBJ text straight from memory.
+     * Only positions are kept: "f" accepts v, v/vt, v/vt/vn and v//vn
+     * references, negative (relative) indices and polygons with any number
+     * of vertices, which are triangulated as a fan. Problems are reported
+     * to log, line by line.
+     */
+
+    Obj_parser(std::vector<Point3D> &vertices, std::vector<int> &indices, int vertex_base = 0, std::ostream &log = std::cerr)
+    : m_vertices(vertices), m_indices(indices), m_vertex_base(vertex_base), m_log(log) { }
+
+    static void count_records(const char *begin, const char *end, int &lines, int &vertices) {
+        /* quick pre-pass used to number lines and vertices of a chunk before parsing it */
+        lines = vertices = 0;
+        for (const char *p = begin; p < end; ++lines) {
+            const char *eol = (const char *) memchr(p, '\n', end - p);
+            if (!eol) eol = end;
+            size_t length;
+            const char *keyword = read_keyword(p, eol, length);
+            if (is_vertex(keyword, length)) ++vertices;
+            p = eol + 1;
+        }
+    }
+
+    void parse(const char *begin, const char *end, int first_line = 1) {
+        int line_number = first_line;
+        for (const char *p = begin; p < end; ++line_number) {
+            const char *eol = (const char *) memchr(p, '\n', end - p);
+            if (!eol) eol = end;
+            parse_line(p, eol, line_number);
+            p = eol + 1;
+        }
+    }
+
+private:
+    std::vector<Point3D> &m_vertices;
+    std::vector<int> &m_indices;
+    std::vector<int> m_face;
+    // number of vertices defined before this parser's part of the file
+    int m_vertex_base;
+    std::ostream &m_log;
+
+    static bool is_space(char c) {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    static const char *skip_spaces(const char *p, const char *end) {
+        while (p < end && is_space(*p)) ++p;
+        return p;
+    }
+
+    static const char *parse_float(const char *p, const char *end, float &value) {
+        /* returns nullptr if there is no number at p */
+        p = skip_spaces(p, end);
+        if (p < end && *p == '+') ++p; // from_chars does not accept a leading '+'
+        auto [ptr, ec] = std::from_chars(p, end, value);
+        return ec == std::errc() ? ptr : nullptr;
+    }
+
+    static const char *parse_int(const char *p, const char *end, int &value) {
+        auto [ptr, ec] = std::from_chars(p, end, value);
+        return ec == std::errc() ? ptr : nullptr;
+    }
+
+    static const char *read_keyword(const char *p, const char *end, size_t &length) {
+        p = skip_spaces(p, end);
+        const char *keyword = p;
+        while (p < end && !is_space(*p)) ++p;
+        length = p - keyword;
+        return keyword;
+    }
+
+    static bool is_vertex(const char *keyword, size_t length) {
+        return length == 1 && keyword[0] == 'v';
+    }
+
+    void parse_line(const char *p, const char *end, int line_number) {
+        size_t length;
+        const char *keyword = read_keyword(p, end, length);
+        p = keyword + length;
+        if (length == 0 || *keyword == '#') return;
+
+        if (is_vertex(keyword, length)) {
+            Point3D v;
+            if (!(p = parse_float(p, end, v.x)) || !(p = parse_float(p, end, v.y)) || !(p = parse_float(p, end, v.z))) {
+                m_log << "Invalid vertex at line " << line_number << '\n';
+                v = { 0, 0, 0 }; // keep the numbering of the following vertices intact
+            }
+            m_vertices.push_back(v);
+        } else if (length == 1 && keyword[0] == 'f') {
+            parse_face(p, end, line_number);
+        } else if (!is_ignored(keyword, length)) {
+            m_log << "Unknown symbol at line " << line_number << ": '" << std::string(keyword, length) << '\'' << '\n';
+        }
+    }
+
+    static bool is_ignored(const char *keyword, size_t length) {
+        /* records that carry nothing the renderer uses */
+        static const char *ignored[] = { "vn", "vt", "vp", "g", "o", "s", "l", "usemtl", "mtllib" };
+        for (const char *k: ignored) {
+            if (strlen(k) == length && memcmp(k, keyword, length) == 0) return true;
+        }
+        return false;
+    }
+
+    void parse_face(const char *p, const char *end, int line_number) {
+        m_face.clear();
+        int vertex_count = m_vertex_base + m_vertices.size();
+        while ((p = skip_spaces(p, end)) < end) {
+            int v, unused;
+            if (!(p = parse_int(p, end, v))) break;
+            // skip the texture coordinate and normal references
+            for (int i = 0; i < 2 && p < end && *p == '/'; ++i) {
+                ++p;
+                if (p < end && *p != '/' && !is_space(*p)) {
+                    if (!(p = parse_int(p, end, unused))) break;
+                }
+            }
+            if (!p) break;
+            int index = v > 0 ? v - 1 : vertex_count + v;
+            if (v == 0 || index < 0 || index >= vertex_count) {
+                m_log << "Invalid vertex index " << v << " at line " << line_number << '\n';
+                return;
+            }
+            m_face.push_back(index);
+        }
+        if (!p || m_face.size() < 3) {
+            m_log << "Invalid face at line " << line_number << '\n';
+            return;
+        }
+        for (size_t i = 1; i + 1 < m_face.size(); ++i) {
+            m_indices.push_back(m_face[0]);
+            m_indices.push_back(m_face[i]);
+            m_indices.push_back(m_face[i + 1]);
+        }
+    }
+};
+
+// files at least this big are parsed in parallel chunks
+#define PARALLEL_OBJ_MIN_SIZE (8 << 20)
+
+void parse_obj_parallel(const char *data, size_t size, std::vector<Point3D> &vertices, std::vector<int> &indices) {
+    /*
+     * Splits the text at line boundaries and parses the chunks on the worker
+     * pool. A counting pre-pass gives every chunk its first line number and
+     * the number of vertices defined before it, so indices (including
+     * negative ones) resolve exactly as in a serial parse. Each chunk keeps
+     * its diagnostics until all are done and they are printed in file
+     * order, so the result and the log are identical to a serial parse.
+     */
+    Thread_pool &pool = worker_pool();
+    size_t chunk_size = std::max<size_t>(size / (pool.size() * 4), 1 << 20);
+
+    std::vector<const char *> bounds = { data };
+    const char *end = data + size;
+    while (bounds.back() < end) {
+        const char *p = bounds.back() + std::min(chunk_size, (size_t) (end - bounds.back()));
+        const char *eol = p < end ? (const char *) memchr(p, '\n', end - p) : nullptr;
+        bounds.push_back(eol ? eol + 1 : end);
+    }
+    int chunk_count = bounds.size() - 1;
+
+    struct Chunk {
+        int lines, vertex_count;
+        int first_line, vertex_base;
+        std::vector<Point3D> vertices;
+        std::vector<int> indices;
+        std::ostringstream log;
+    };
+    std::vector<Chunk> chunks(chunk_count);
+
+    pool.parallel_for(chunk_count, [&](int i) {
+        Obj_parser::count_records(bounds[i], bounds[i + 1], chunks[i].lines, chunks[i].vertex_count);
+    });
+    int line = 1, vertex_base = 0;
+    for (auto &c: chunks) {
+        c.first_line = line;
+        c.vertex_base = vertex_base;
+        line += c.lines;
+        vertex_base += c.vertex_count;
+    }
+
+    pool.parallel_for(chunk_count, [&](int i) {
+        Chunk &c = chunks[i];
+        c.vertices.reserve(c.vertex_count);
+        Obj_parser parser(c.vertices, c.indices, c.vertex_base, c.log);
+        parser.parse(bounds[i], bounds[i + 1], c.first_line);
+    });
+    for (auto &c: chunks) std::cerr << c.log.str();
+
+    // stitch the chunks together in file order
+    std::vector<size_t> index_offsets(chunk_count);
+    size_t index_count = indices.size();
+    for (int i = 0; i < chunk_count; ++i) {
+        index_offsets[i] = index_count;
+        index_count += chunks[i].indices.size();
+    }
+    size_t first_vertex = vertices.size();
+    vertices.resize(first_vertex + vertex_base);
+    indices.resize(index_count);
+    pool.parallel_for(chunk_count, [&](int i) {
+        std::copy(chunks[i].vertices.begin(), chunks[i].vertices.end(), vertices.begin() + first_vertex + chunks[i].vertex_base);
+        std::copy(chunks[i].indices.begin(), chunks[i].indices.end(), indices.begin() + index_offsets[i]);
+    });
+}
+
+bool load_obj(const std::string &filepath, std::vector<Point3D> &vertices, std::vector<int> &indices) {
+    auto start = std::chrono::steady_clock::now();
+    Mapped_file file(filepath);
+    if (!file.is_open()) {
+        std::cerr << "Error: failed to open " << filepath << '\n';
+        return false;
+    }
+    bool parallel = file.size() >= PARALLEL_OBJ_MIN_SIZE && worker_pool().size() > 1;
+    if (parallel) {
+        parse_obj_parallel(file.data(), file.size(), vertices, indices);
+    } else {
+        Obj_parser parser(vertices, indices);
+        parser.parse(file.data(), file.data() + file.size());
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double megabytes = file.size() / (1024.0 * 1024.0);
+    SDL_Log("Loaded %s%s: %zu vertices, %zu triangles, %.2f MB in %.2f ms (%.1f MB/s)",
+            filepath.c_str(), parallel ? " (parallel)" : "", vertices.size(), indices.size() / 3,
+            megabytes, seconds * 1000, seconds > 0 ? megabytes / seconds : 0.0);
+    return true;
+}
+
+/******************** Vertex kernels ****************************************/
+
+/*
+ * Batch kernels over structure-of-arrays streams: transform, project and
+ * classify vertices, and test which triangles face the camera. The SSE2
+ * and AVX2 versions do the same float operations in the same order as the
+ * scalar one (no FMA), so every level gives bit-identical results. Streams
+ * are padded to SIMD_PADDING elements so the kernels never need a tail.
+ */
+
+// 32-bit x86 only guarantees SSE2 when the compiler was told so
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+#define SIMD_PADDING 8
+
+enum Simd_level {
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2,
+};
+
+const char *simd_level_name(Simd_level level) {
+    switch (level) {
+        case SIMD_SCALAR: return "scalar";
+        case SIMD_SSE2:   return "sse2";
+        case SIMD_AVX2:   return "avx2";
+    }
+    return "unknown";
+}
+
+Simd_level detect_simd_level() {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2")) return SIMD_SSE2;
+#endif
+    return SIMD_SCALAR;
+}
+
+const Simd_level g_simd_supported = detect_simd_level();
+Simd_level g_simd_level = g_simd_supported;
+
+inline int simd_padded(int count) {
+    return (count + SIMD_PADDING - 1) & ~(SIMD_PADDING - 1);
+}
+
+struct Vertex_streams {
+    const float *x = nullptr, *y = nullptr, *z = nullptr;
+};
+
+struct Face_streams {
+    /* one plane per triangle, n.dot(p) + d > 0 for points in front of it */
+    const float *x = nullptr, *y = nullptr, *z = nullptr, *d = nullptr;
+};
+
+struct Camera_vertices {
+    struct { float *x, *y, *z; } camera;
+    float *screen_x, *screen_y;
+    int *outcodes;
+};
+
+void transform_vertices_scalar(const Mat4 &m, const Plane *planes, const Vertex_streams &in, int count, Camera_vertices &out) {
+    float half_width = render_width * 0.5f, half_height = render_height * 0.5f;
+    for (int i = 0; i < count; ++i) {
+        float x = in.x[i], y = in.y[i], z = in.z[i];
+        float cx = m.m[0][0] * x + m.m[0][1] * y + m.m[0][2] * z + m.m[0][3];
+        float cy = m.m[1][0] * x + m.m[1][1] * y + m.m[1][2] * z + m.m[1][3];
+        float cz = m.m[2][0] * x + m.m[2][1] * y + m.m[2][2] * z + m.m[2][3];
+        out.camera.x[i] = cx;
+        out.camera.y[i] = cy;
+        out.camera.z[i] = cz;
+
+        float w = std::max(cz, NEAR_PLANE) * tana2;
+        out.screen_x[i] = cx / w * render_width + half_width;
+        out.screen_y[i] = cy / w * render_width + half_height;
+
+        int code = 0;
+        for (int p = 0; p < CLIP_PLANE_COUNT; ++p) {
+            const Plane &plane = planes[p];
+            if (plane.n.x * cx + plane.n.y * cy + plane.n.z * cz + plane.d < 0) code |= 1 << p;
+        }
+        out.outcodes[i] = code;
+    }
+}
+
+void facing_triangles_scalar(const Face_streams &faces, Point3D eye, int count, uint8_t *facing) {
+    for (int i = 0; i < count; ++i) {
+        facing[i] = faces.x[i] * eye.x + faces.y[i] * eye.y + faces.z[i] * eye.z + faces.d[i] > 0;
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+void transform_vertices_sse2(const Mat4 &m, const Plane *planes, const Vertex_streams &in, int count, Camera_vertices &out) {
+    __m128 near = _mm_set1_ps(NEAR_PLANE), tan = _mm_set1_ps(tana2), width = _mm_set1_ps((float) render_width);
+    __m128 half_width = _mm_set1_ps(render_width * 0.5f), half_height = _mm_set1_ps(render_height * 0.5f);
+    for (int i = 0; i < count; i += 4) {
+        __m128 x = _mm_loadu_ps(in.x + i), y = _mm_loadu_ps(in.y + i), z = _mm_loadu_ps(in.z + i);
+        __m128 c[3];
+        for (int r = 0; r < 3; ++r) {
+            c[r] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m.m[r][0]), x), _mm_mul_ps(_mm_set1_ps(m.m[r][1]), y)),
+                                         _mm_mul_ps(_mm_set1_ps(m.m[r][2]), z)), _mm_set1_ps(m.m[r][3]));
+        }
+        _mm_storeu_ps(out.camera.x + i, c[0]);
+        _mm_storeu_ps(out.camera.y + i, c[1]);
+        _mm_storeu_ps(out.camera.z + i, c[2]);
+
+        __m128 w = _mm_mul_ps(_mm_max_ps(c[2], near), tan);
+        _mm_storeu_ps(out.screen_x + i, _mm_add_ps(_mm_mul_ps(_mm_div_ps(c[0], w), width), half_width));
+        _mm_storeu_ps(out.screen_y + i, _mm_add_ps(_mm_mul_ps(_mm_div_ps(c[1], w), width), half_height));
+
+        __m128i code = _mm_setzero_si128();
+        for (int p = 0; p < CLIP_PLANE_COUNT; ++p) {
+            const Plane &plane = planes[p];
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.n.x), c[0]), _mm_mul_ps(_mm_set1_ps(plane.n.y), c[1])),
+                                                    _mm_mul_ps(_mm_set1_ps(plane.n.z), c[2])), _mm_set1_ps(plane.d));
+            __m128i outside = _mm_castps_si128(_mm_cmplt_ps(distance, _mm_setzero_ps()));
+            code = _mm_or_si128(code, _mm_and_si128(outside, _mm_set1_epi32(1 << p)));
+        }
+        _mm_storeu_si128((__m128i *) (out.outcodes + i), code);
+    }
+}
+
+void facing_triangles_sse2(const Face_streams &faces, Point3D eye, int count, uint8_t *facing) {
+    __m128 ex = _mm_set1_ps(eye.x), ey = _mm_set1_ps(eye.y), ez = _mm_set1_ps(eye.z);
+    for (int i = 0; i < count; i += 4) {
+        __m128 distance = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(faces.x + i), ex), _mm_mul_ps(_mm_loadu_ps(faces.y + i), ey)),
+                                                _mm_mul_ps(_mm_loadu_ps(faces.z + i), ez)), _mm_loadu_ps(faces.d + i));
+        int mask = _mm_movemask_ps(_mm_cmpgt_ps(distance, _mm_setzero_ps()));
+        for (int j = 0; j < 4; ++j) facing[i + j] = mask >> j & 1;
+    }
+}
+
+__attribute__((target("avx2")))
+void transform_vertices_avx2(const Mat4 &m, const Plane *planes, const Vertex_streams &in, int count, Camera_vertices &out) {
+    __m256 near = _mm256_set1_ps(NEAR_PLANE), tan = _mm256_set1_ps(tana2), width = _mm256_set1_ps((float) render_width);
+    __m256 half_width = _mm256_set1_ps(render_width * 0.5f), half_height = _mm256_set1_ps(render_height * 0.5f);
+    for (int i = 0; i < count; i += 8) {
+        __m256 x = _mm256_loadu_ps(in.x + i), y = _mm256_loadu_ps(in.y + i), z = _mm256_loadu_ps(in.z + i);
+        __m256 c[3];
+        for (int r = 0; r < 3; ++r) {
+            c[r] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(m.m[r][0]), x), _mm256_mul_ps(_mm256_set1_ps(m.m[r][1]), y)),
+                                               _mm256_mul_ps(_mm256_set1_ps(m.m[r][2]), z)), _mm256_set1_ps(m.m[r][3]));
+        }
+        _mm256_storeu_ps(out.camera.x + i, c[0]);
+        _mm256_storeu_ps(out.camera.y + i, c[1]);
+        _mm256_storeu_ps(out.camera.z + i, c[2]);
+
+        __m256 w = _mm256_mul_ps(_mm256_max_ps(c[2], near), tan);
+        _mm256_storeu_ps(out.screen_x + i, _mm256_add_ps(_mm256_mul_ps(_mm256_div_ps(c[0], w), width), half_width));
+        _mm256_storeu_ps(out.screen_y + i, _mm256_add_ps(_mm256_mul_ps(_mm256_div_ps(c[1], w), width), half_height));
+
+        __m256i code = _mm256_setzero_si256();
+        for (int p = 0; p < CLIP_PLANE_COUNT; ++p) {
+            const Plane &plane = planes[p];
+            __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane.n.x), c[0]), _mm256_mul_ps(_mm256_set1_ps(plane.n.y), c[1])),
+                                                          _mm256_mul_ps(_mm256_set1_ps(plane.n.z), c[2])), _mm256_set1_ps(plane.d));
+            __m256i outside = _mm256_castps_si256(_mm256_cmp_ps(distance, _mm256_setzero_ps(), _CMP_LT_OQ));
+            code = _mm256_or_si256(code, _mm256_and_si256(outside, _mm256_set1_epi32(1 << p)));
+        }
+        _mm256_storeu_si256((__m256i *) (out.outcodes + i), code);
+    }
+}
+
+__attribute__((target("avx2")))
+void facing_triangles_avx2(const Face_streams &faces, Point3D eye, int count, uint8_t *facing) {
+    __m256 ex = _mm256_set1_ps(eye.x), ey = _mm256_set1_ps(eye.y), ez = _mm256_set1_ps(eye.z);
+    for (int i = 0; i < count; i += 8) {
+        __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(faces.x + i), ex), _mm256_mul_ps(_mm256_loadu_ps(faces.y + i), ey)),
+                                                      _mm256_mul_ps(_mm256_loadu_ps(faces.z + i), ez)), _mm256_loadu_ps(faces.d + i));
+        int mask = _mm256_movemask_ps(_mm256_cmp_ps(distance, _mm256_setzero_ps(), _CMP_GT_OQ));
+        for (int j = 0; j < 8; ++j) facing[i + j] = mask >> j & 1;
+    }
+}
+
+#endif
+
+void transform_vertices(const Mat4 &model_view, const Plane *planes, const Vertex_streams &in, int count, Camera_vertices &out) {
+    /* model_view has to be affine, count is rounded up to the padding and out sized for it */
+    count = simd_padded(count);
+    switch (g_simd_level) {
+#ifdef HAVE_X86_KERNELS
+        case SIMD_AVX2: transform_vertices_avx2(model_view, planes, in, count, out); return;
+        case SIMD_SSE2: transform_vertices_sse2(model_view, planes, in, count, out); return;
+#endif
+        default:        transform_vertices_scalar(model_view, planes, in, count, out); return;
+    }
+}
+
+void facing_triangles(const Face_streams &faces, Point3D eye, int count, uint8_t *facing) {
+    /* facing[i] is 1 if eye is in front of triangle i's plane */
+    count = simd_padded(count);
+    switch (g_simd_level) {
+#ifdef HAVE_X86_KERNELS
+        case SIMD_AVX2: facing_triangles_avx2(faces, eye, count, facing); return;
+        case SIMD_SSE2: facing_triangles_sse2(faces, eye, count, facing); return;
+#endif
+        default:        facing_triangles_scalar(faces, eye, count, facing); return;
+    }
+}
+
+/******************** Mesh simplification ***********************************/
+
+struct Quadric {
+    /*
+     * Sum of squared distances to a set of weighted planes (a, b, c, d),
+     * stored as the upper triangle of the symmetric 4x4 matrix
+     * aa ab ac ad bb bc bd cc cd dd
+     */
+    double q[10] = {};
+
+    void add_plane(double a, double b, double c, double d, double weight) {
+        double plane[4] = { a, b, c, d };
+        int k = 0;
+        for (int i = 0; i < 4; ++i) {
+            for (int j = i; j < 4; ++j) q[k++] += weight * plane[i] * plane[j];
+        }
+    }
+
+    Quadric &operator+=(const Quadric &other) {
+        for (int i = 0; i < 10; ++i) q[i] += other.q[i];
+        return *this;
+    }
+
+    double error(const Point3D &p) const {
+        double x = p.x, y = p.y, z = p.z;
+        double e = q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x
+                 + q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y
+                 + q[7] * z * z + 2 * q[8] * z + q[9];
+        return std::max(e, 0.0);
+    }
+
+    bool minimum(Point3D &p) const {
+        /* the point of least error, false if the planes do not pin one down */
+        double a[3][3] = { { q[0], q[1], q[2] }, { q[1], q[4], q[5] }, { q[2], q[5], q[7] } };
+        double b[3] = { -q[3], -q[6], -q[8] };
+        double det = a[0][0] * (a[1][1] * a[2][2] - a[1][2] * a[2][1])
+                   - a[0][1] * (a[1][0] * a[2][2] - a[1][2] * a[2][0])
+                   + a[0][2] * (a[1][0] * a[2][1] - a[1][1] * a[2][0]);
+        double scale = a[0][0] + a[1][1] + a[2][2];
+        if (!(std::abs(det) > 1e-9 * scale * scale * scale)) return false;
+        double r[3];
+        for (int i = 0; i < 3; ++i) {
+            // Cramer's rule, column i replaced by b
+            double m[3][3];
+            for (int row = 0; row < 3; ++row) {
+                for (int col = 0; col < 3; ++col) m[row][col] = col == i ? b[row] : a[row][col];
+            }
+            r[i] = (m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+                  - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+                  + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0])) / det;
+        }
+        p = { (float) r[0], (float) r[1], (float) r[2] };
+        return true;
+    }
+};
+
+class Mesh_simplifier {
+    /*
+     * Quadric error edge collapse (Garland and Heckbert): every vertex
+     * collects the planes of its triangles, and the edge whose merged
+     * vertex would move least away from those planes is collapsed first.
+     * Open borders get extra perpendicular planes so they keep their
+     * outline, and collapses that would flip a triangle are skipped.
+     */
+public:
+    Mesh_simplifier(const Point3D *vertices, int vertex_count, const int *indices, int triangle_count)
+            : m_positions(vertices, vertices + vertex_count), m_indices(indices, indices + 3 * triangle_count),
+              m_quadrics(vertex_count), m_vertex_triangles(vertex_count), m_versions(vertex_count, 0),
+              m_removed(triangle_count, false), m_live_triangles(triangle_count) {
+        std::unordered_map<uint64_t, int> edges;
+        for (int t = 0; t < triangle_count; ++t) {
+            const int *index = &m_indices[t * 3];
+            Vec3 n = (m_positions[index[1]] - m_positions[index[0]]).cross(m_positions[index[2]] - m_positions[index[0]]);
+            float area = sqrtf(n.dot(n));
+            if (area > 0) {
+                n = n * (1 / area);
+                for (int j = 0; j < 3; ++j) m_quadrics[index[j]].add_plane(n.x, n.y, n.z, -n.dot(m_positions[index[0]]), area);
+            }
+            for (int j = 0; j < 3; ++j) {
+                m_vertex_triangles[index[j]].push_back(t);
+                ++edges[edge_key(index[j], index[(j + 1) % 3])];
+            }
+        }
+
+        // edges used by a single triangle are on the border
+        for (int t = 0; t < triangle_count; ++t) {
+            const int *index = &m_indices[t * 3];
+            Vec3 n = (m_positions[index[1]] - m_positions[index[0]]).cross(m_positions[index[2]] - m_positions[index[0]]);
+            for (int j = 0; j < 3; ++j) {
+                int a = index[j], b = index[(j + 1) % 3];
+                if (edges[edge_key(a, b)] != 1) continue;
+                Vec3 edge = m_positions[b] - m_positions[a];
+                Vec3 side = edge.cross(n);
+                float length = sqrtf(side.dot(side));
+                if (length == 0) continue;
+                side = side * (1 / length);
+                double weight = BORDER_WEIGHT * edge.dot(edge);
+                m_quadrics[a].add_plane(side.x, side.y, side.z, -side.dot(m_positions[a]), weight);
+                m_quadrics[b].add_plane(side.x, side.y, side.z, -side.dot(m_positions[a]), weight);
+            }
+        }
+
+        for (auto &edge: edges) {
+            push_collapse(edge.first >> 32, edge.first & 0xFFFFFFFF);
+        }
+    }
+
+    void simplify(int target_triangles, std::vector<Point3D> &vertices, std::vector<int> &indices) {
+        while (m_live_triangles > target_triangles && !m_collapses.empty()) {
+            Collapse c = m_collapses.top();
+            m_collapses.pop();
+            if (c.version_a != m_versions[c.a] || c.version_b != m_versions[c.b]) continue; // outdated
+            if (flips(c.a, c.b, c.position) || flips(c.b, c.a, c.position)) continue;
+            collapse(c.a, c.b, c.position);
+        }
+
+        // keep the vertices still in use, in their original order
+        std::vector<int> remap(m_positions.size(), -1);
+        for (size_t t = 0; t < m_removed.size(); ++t) {
+            if (m_removed[t]) continue;
+            for (int j = 0; j < 3; ++j) remap[m_indices[t * 3 + j]] = 0;
+        }
+        vertices.clear();
+        indices.clear();
+        for (size_t v = 0; v < remap.size(); ++v) {
+            if (remap[v] < 0) continue;
+            remap[v] = vertices.size();
+            vertices.push_back(m_positions[v]);
+        }
+        for (size_t t = 0; t < m_removed.size(); ++t) {
+            if (m_removed[t]) continue;
+            for (int j = 0; j < 3; ++j) indices.push_back(remap[m_indices[t * 3 + j]]);
+        }
+    }
+
+private:
+    static constexpr double BORDER_WEIGHT = 1000;
+
+    struct Collapse {
+        double cost;
+        int a, b;
+        int version_a, version_b;
+        Point3D position;
+
+        bool operator<(const Collapse &other) const {
+            return cost > other.cost; // cheapest on top of the priority queue
+        }
+    };
+
+    std::vector<Point3D> m_positions;
+    std::vector<int> m_indices;
+    std::vector<Quadric> m_quadrics;
+    std::vector<std::vector<int>> m_vertex_triangles;
+    std::vector<int> m_versions;
+    std::vector<bool> m_removed;
+    int m_live_triangles;
+    std::priority_queue<Collapse> m_collapses;
+
+    static uint64_t edge_key(uint32_t a, uint32_t b) {
+        return a < b ? (uint64_t) a << 32 | b : (uint64_t) b << 32 | a;
+    }
+
+    void push_collapse(int a, int b) {
+        Quadric q = m_quadrics[a];
+        q += m_quadrics[b];
+        Point3D pa = m_positions[a], pb = m_positions[b];
+        Point3D middle = (pa + pb) * 0.5f;
+        Vec3 edge = pb - pa;
+        Point3D best;
+        // the exact minimum is only trusted close to the edge, far off it comes from nearly parallel planes
+        if (!q.minimum(best) || (best - middle).dot(best - middle) > edge.dot(edge)) {
+            best = middle;
+            for (Point3D p: { pa, pb }) {
+                if (q.error(p) < q.error(best)) best = p;
+            }
+        }
+        m_collapses.push({ q.error(best), a, b, m_versions[a], m_versions[b], best });
+    }
+
+    bool flips(int v, int other, Point3D position) {
+        /* true if moving v to position turns one of its triangles not shared with other over */
+        for (int t: m_vertex_triangles[v]) {
+            if (m_removed[t]) continue;
+            const int *index = &m_indices[t * 3];
+            if (index[0] == other || index[1] == other || index[2] == other) continue;
+            Point3D p[3], moved[3];
+            for (int j = 0; j < 3; ++j) {
+                p[j] = m_positions[index[j]];
+                moved[j] = index[j] == v ? position : p[j];
+            }
+            Vec3 before = (p[1] - p[0]).cross(p[2] - p[0]);
+            Vec3 after = (moved[1] - moved[0]).cross(moved[2] - moved[0]);
+            if (after.dot(before) <= 0.2f * sqrtf(after.dot(after) * before.dot(before))) return true;
+        }
+        return false;
+    }
+
+    void collapse(int a, int b, Point3D position) {
+        /* merges b into a */
+        m_positions[a] = position;
+        m_quadrics[a] += m_quadrics[b];
+        ++m_versions[a];
+        ++m_versions[b];
+
+        for (int t: m_vertex_triangles[b]) {
+            if (m_removed[t]) continue;
+            int *index = &m_indices[t * 3];
+            bool shared = index[0] == a || index[1] == a || index[2] == a;
+            if (shared) {
+                m_removed[t] = true;
+                --m_live_triangles;
+                continue;
+            }
+            for (int j = 0; j < 3; ++j) {
+                if (index[j] == b) index[j] = a;
+            }
+            m_vertex_triangles[a].push_back(t);
+        }
+        m_vertex_triangles[b].clear();
+
+        // drop removed triangles and queue the changed edges around a
+        auto &triangles = m_vertex_triangles[a];
+        triangles.erase(std::remove_if(triangles.begin(), triangles.end(), [this](int t) { return m_removed[t]; }), triangles.end());
+        for (int t: triangles) {
+            for (int j = 0; j < 3; ++j) {
+                int v = m_indices[t * 3 + j];
+                if (v != a) push_collapse(a, v);
+            }
+        }
+    }
+};
+
+// has to change whenever the simplifier's output does, so cached levels of detail are rebuilt
+#define SIMPLIFIER_VERSION 1
+
+void simplify_mesh(const Point3D *vertices, int vertex_count, const int *indices, int triangle_count, int target_triangles,
+                   std::vector<Point3D> &out_vertices, std::vector<int> &out_indices) {
+    /* reduces an indexed triangle mesh to about target_triangles */
+    Mesh_simplifier simplifier(vertices, vertex_count, indices, triangle_count);
+    simplifier.simplify(target_triangles, out_vertices, out_indices);
+}
+
+/******************** Occlusion culling *************************************/
+
+// width of the occlusion depth buffer, its height follows the render size's aspect ratio
+#define OCCLUSION_WIDTH 256
+// most polygons rasterized as occluders per frame, the largest on screen win
+#define OCCLUDER_BUDGET 4096
+// most vertices of an occluder: a quad clipped by every plane
+#define MAX_OCCLUDER_VERTICES (4 + CLIP_PLANE_COUNT)
+// meshes with more triangles do not occlude; their simplified levels may reach past the real surface
+#define OCCLUDER_MAX_MESH_TRIANGLES 4096
+// texels read along each side of an occludee's rectangle, at most; more texels means finer levels
+#define OCCLUSION_QUERY_TEXELS 4
+// how much further than the occluders an object has to be, against rounding in the depth planes
+#define OCCLUSION_EPSILON 1e-4f
+
+bool g_occlusion_culling = true;
+
+struct Occlusion_buffer {
+    /*
+     * Low-resolution inverse depth buffer of the occluders of a frame
+     * (bigger is nearer, 0 is empty) and a pyramid above it in which
+     * every texel holds the furthest depth of the four under it.
+     * A pixel takes an occluder's depth at its furthest corner if the
+     * occluder covers its center, so polygons sharing an edge leave no
+     * cracks. A box is occluded when its nearest point is behind the
+     * furthest occluder depth over its whole screen rectangle grown by a
+     * pixel on every side, so the part of an edge pixel an occluder may
+     * not cover cannot hide anything. The pyramid answers that from at
+     * most OCCLUSION_QUERY_TEXELS squared texels. Occluders are
+     * collected first and only the OCCLUDER_BUDGET largest on screen
+     * are rasterized.
+     */
+
+    void begin_frame(const Player &player) {
+        /* empty, so nothing is occluded until build_pyramid() */
+        m_active = false;
+        m_used = 0;
+        m_candidates.clear();
+        m_planes = player.m_clip_planes;
+        m_view = player.m_view;
+        int width = OCCLUSION_WIDTH, height = std::max(OCCLUSION_WIDTH * render_height / std::max(render_width, 1), 1);
+        if (m_levels.empty() || width != m_levels[0].width || height != m_levels[0].height) {
+            m_levels.clear();
+            for (;;) {
+                m_levels.push_back({ width, height, std::vector<float>((size_t) width * height) });
+                if (width == 1 && height == 1) break;
+                width = (width + 1) / 2;
+                height = (height + 1) / 2;
+            }
+        }
+        std::fill(m_levels[0].depth.begin(), m_levels[0].depth.end(), 0.0f);
+    }
+
+    void add_occluder(Point3D *poly, int count, int codes) {
+        /*
+         * a convex polygon in camera space, codes is the or of its vertices'
+         * outcodes, poly needs room for count + CLIP_PLANE_COUNT points
+         */
+        if (codes) count = clip_polygon(poly, count, codes, m_planes);
+        if (count < 3) return;
+
+        const Level &level = m_levels[0];
+        Occluder o;
+        o.count = count;
+        o.area = 0;
+        for (int i = 0; i < count; ++i) {
+            Point2D p = project(poly[i]);
+            o.x[i] = p.x * level.width + level.width * 0.5f;
+            o.y[i] = p.y * level.width + level.height * 0.5f;
+            o.d[i] = inverse_depth(poly[i].z);
+        }
+        for (int i = 0; i < count; ++i) {
+            int j = (i + 1) % count;
+            o.area += o.x[i] * o.y[j] - o.x[j] * o.y[i];
+        }
+        if (fabsf(o.area) < 1e-6f) return;
+        m_candidates.push_back(o);
+    }
+
+    void build_pyramid() {
+        /*
+         * rasterizes the largest occluders, then every texel above the
+         * buffer gets the furthest of the up to four texels under it
+         */
+        int count = m_candidates.size();
+        m_ranked.resize(count);
+        for (int i = 0; i < count; ++i) {
+            // positive floats order like their bits
+            float area = fabsf(m_candidates[i].area);
+            uint32_t bits;
+            memcpy(&bits, &area, sizeof bits);
+            m_ranked[i] = (uint64_t) bits << 32 | (uint32_t) i;
+        }
+        if (count > OCCLUDER_BUDGET) {
+            std::nth_element(m_ranked.begin(), m_ranked.begin() + OCCLUDER_BUDGET, m_ranked.end(), std::greater<uint64_t>());
+            count = OCCLUDER_BUDGET;
+        }
+        for (int i = 0; i < count; ++i) {
+            rasterize(m_candidates[(uint32_t) m_ranked[i]]);
+        }
+        m_used = count;
+
+        // without occluders nothing can be hidden, so the boxes are not even projected
+        if (!m_used) return;
+        for (size_t l = 1; l < m_levels.size(); ++l) {
+            const Level &below = m_levels[l - 1];
+            Level &level = m_levels[l];
+            for (int y = 0; y < level.height; ++y) {
+                int y0 = 2 * y, y1 = std::min(2 * y + 1, below.height - 1);
+                for (int x = 0; x < level.width; ++x) {
+                    int x0 = 2 * x, x1 = std::min(2 * x + 1, below.width - 1);
+                    level.depth[(size_t) y * level.width + x] = std::min(
+                        std::min(below.depth[(size_t) y0 * below.width + x0], below.depth[(size_t) y0 * below.width + x1]),
+                        std::min(below.depth[(size_t) y1 * below.width + x0], below.depth[(size_t) y1 * below.width + x1]));
+                }
+            }
+        }
+        m_active = true;
+    }
+
+    bool occludes(const Box &box) {
+        /* for a world-space box inside the view, counted in g_frame_stats */
+        if (!m_active) return false;
+        const Level &base = m_levels[0];
+        float min_x = INFINITY, min_y = INFINITY, max_x = -INFINITY, max_y = -INFINITY, nearest = 0;
+        bool in_front = true;
+        for (int i = 0; i < 8 && in_front; ++i) {
+            Point3D p = m_view.transform_affine({ i & 1 ? box.max.x : box.min.x, i & 2 ? box.max.y : box.min.y, i & 4 ? box.max.z : box.min.z });
+            // a box reaching behind the near plane covers too much of the screen to tell
+            in_front = p.z >= NEAR_PLANE;
+            Point2D s = project(p);
+            min_x = std::min(min_x, s.x), max_x = std::max(max_x, s.x);
+            min_y = std::min(min_y, s.y), max_y = std::max(max_y, s.y);
+            nearest = std::max(nearest, inverse_depth(p.z));
+        }
+        int x0 = std::max((int) floorf(min_x * base.width + base.width * 0.5f) - 1, 0);
+        int x1 = std::min((int) floorf(max_x * base.width + base.width * 0.5f) + 1, base.width - 1);
+        int y0 = std::max((int) floorf(min_y * base.width + base.height * 0.5f) - 1, 0);
+        int y1 = std::min((int) floorf(max_y * base.width + base.height * 0.5f) + 1, base.height - 1);
+
+        bool occluded = in_front && x0 <= x1 && y0 <= y1;
+        if (occluded) {
+            // the finest level where the rectangle spans no more than OCCLUSION_QUERY_TEXELS each way
+            int l = 0;
+            while ((x1 >> l) - (x0 >> l) >= OCCLUSION_QUERY_TEXELS || (y1 >> l) - (y0 >> l) >= OCCLUSION_QUERY_TEXELS) ++l;
+            const Level &level = m_levels[l];
+            for (int y = y0 >> l; y <= y1 >> l && occluded; ++y) {
+                for (int x = x0 >> l; x <= x1 >> l && occluded; ++x) {
+                    occluded = level.depth[(size_t) y * level.width + x] > nearest * (1 + OCCLUSION_EPSILON);
+                }
+            }
+        }
+        ++(occluded ? g_frame_stats.occluded : g_frame_stats.unoccluded);
+        return occluded;
+    }
+
+private:
+    struct Level {
+        int width;
+        int height;
+        std::vector<float> depth;
+    };
+
+    struct Occluder {
+        // in texels of the buffer, and inverse depth
+        float x[MAX_OCCLUDER_VERTICES], y[MAX_OCCLUDER_VERTICES], d[MAX_OCCLUDER_VERTICES];
+        int count;
+        float area; // twice the signed area on screen
+    };
+
+    std::vector<Level> m_levels; // the buffer, then ever coarser
+    Frame_array<Occluder> m_candidates;
+    Frame_array<uint64_t> m_ranked; // (screen area << 32 | candidate), largest first up to the budget
+    bool m_active = false;
+    int m_used = 0; // occluders rasterized this frame
+    const Plane *m_planes = nullptr;
+    Mat4 m_view;
+
+    void rasterize(const Occluder &o) {
+        Level &level = m_levels[0];
+        int count = o.count;
+        const float *x = o.x, *y = o.y, *d = o.d;
+        float min_x = *std::min_element(x, x + count), max_x = *std::max_element(x, x + count);
+        float min_y = *std::min_element(y, y + count), max_y = *std::max_element(y, y + count);
+        float side = o.area > 0 ? 1 : -1;
+
+        // inverse depth is linear on screen: d = a * x + b * y + c, through the widest corner of the polygon
+        int k = 1;
+        float best = 0;
+        for (int i = 1; i + 1 < count; ++i) {
+            float det = (x[i] - x[0]) * (y[i + 1] - y[0]) - (x[i + 1] - x[0]) * (y[i] - y[0]);
+            if (fabsf(det) > fabsf(best)) best = det, k = i;
+        }
+        float a = ((d[k] - d[0]) * (y[k + 1] - y[0]) - (d[k + 1] - d[0]) * (y[k] - y[0])) / best;
+        float b = ((x[k] - x[0]) * (d[k + 1] - d[0]) - (x[k + 1] - x[0]) * (d[k] - d[0])) / best;
+        float c = d[0] - a * x[0] - b * y[0];
+        // from a pixel's center to its furthest corner, which may lie outside the polygon but not further than its furthest vertex
+        float corner = 0.5f * (fabsf(a) + fabsf(b));
+        float furthest = *std::min_element(d, d + count);
+
+        // edge functions, positive inside
+        float ea[MAX_OCCLUDER_VERTICES], eb[MAX_OCCLUDER_VERTICES], ec[MAX_OCCLUDER_VERTICES];
+        for (int i = 0; i < count; ++i) {
+            int j = (i + 1) % count;
+            ea[i] = -(y[j] - y[i]) * side;
+            eb[i] = (x[j] - x[i]) * side;
+            ec[i] = -(ea[i] * x[i] + eb[i] * y[i]);
+        }
+
+        int x0 = std::max((int) floorf(min_x), 0), x1 = std::min((int) ceilf(max_x), level.width) - 1;
+        int y0 = std::max((int) floorf(min_y), 0), y1 = std::min((int) ceilf(max_y), level.height) - 1;
+        for (int py = y0; py <= y1; ++py) {
+            float cy = py + 0.5f;
+            float *row = &level.depth[(size_t) py * level.width];
+            for (int px = x0; px <= x1; ++px) {
+                float cx = px + 0.5f;
+                bool inside = true;
+                for (int i = 0; i < count && inside; ++i) {
+                    inside = ea[i] * cx + eb[i] * cy + ec[i] >= 0;
+                }
+                if (inside) row[px] = std::max(row[px], std::max(a * cx + b * cy + c - corner, furthest));
+            }
+        }
+    }
+};
+
+Occlusion_buffer g_occlusion;
+
+/******************** Bounding volume hierarchy *****************************/
+
+// leaves keep their box grown by this much, so small moves need no refit
+#define BVH_MARGIN 0.1f
+// traversal stack size, more than the height of any tree that fits in memory
+#define BVH_STACK_SIZE 128
+
+class Aabb_tree {
+    /*
+     * Dynamic bounding volume hierarchy over boxes, every leaf carrying an
+     * int item of the caller's. A new leaf goes next to the node that grows
+     * the total surface area the least, and the path back to the root is
+     * rebalanced with tree rotations, so the height stays logarithmic
+     * whatever order leaves come and go in. Leaves keep their box grown by
+     * BVH_MARGIN; a move that stays inside it costs nothing. Proxies stay
+     * valid until they are removed.
+     */
+public:
+    int insert(const Box &box, int item) {
+        int leaf = allocate();
+        Node &n = m_nodes[leaf];
+        n.box = { box.min - Vec3{ BVH_MARGIN, BVH_MARGIN, BVH_MARGIN }, box.max + Vec3{ BVH_MARGIN, BVH_MARGIN, BVH_MARGIN } };
+        n.child[0] = n.child[1] = -1;
+        n.height = 0;
+        n.item = item;
+        insert_leaf(leaf);
+        return leaf;
+    }
+
+    void remove(int proxy) {
+        remove_leaf(proxy);
+        release(proxy);
+    }
+
+    bool move(int proxy, const Box &box) {
+        /* returns false if box still fits the leaf and nothing changed */
+        if (m_nodes[proxy].box.contains(box)) return false;
+        remove_leaf(proxy);
+        m_nodes[proxy].box = { box.min - Vec3{ BVH_MARGIN, BVH_MARGIN, BVH_MARGIN }, box.max + Vec3{ BVH_MARGIN, BVH_MARGIN, BVH_MARGIN } };
+        insert_leaf(proxy);
+        return true;
+    }
+
+    int size() const {
+        return m_leaves;
+    }
+
+    bool bounds(Box &box) const {
+        /* the box around all leaves, false if the tree is empty */
+        if (m_root < 0) return false;
+        box = m_nodes[m_root].box;
+        return true;
+    }
+
+    template <typename Visit>
+    void query_frustum(const Plane *planes, int plane_count, Visit &&visit) const {
+        /*
+         * visit(item) for every leaf not completely outside one of the
+         * planes; a subtree completely inside a plane is not tested
+         * against it again, one inside all of them is not tested at all
+         */
+        if (m_root < 0) return;
+        struct Entry { int node; int planes; };
+        Entry stack[BVH_STACK_SIZE];
+        int top = 0;
+        stack[top++] = { m_root, (1 << plane_count) - 1 };
+        while (top) {
+            Entry e = stack[--top];
+            const Node &n = m_nodes[e.node];
+            bool outside = false;
+            for (int i = 0; i < plane_count && !outside; ++i) {
+                if (!(e.planes & 1 << i)) continue;
+                const Plane &p = planes[i];
+                // the corners furthest along and against the plane normal
+                Point3D front = { p.n.x >= 0 ? n.box.max.x : n.box.min.x, p.n.y >= 0 ? n.box.max.y : n.box.min.y, p.n.z >= 0 ? n.box.max.z : n.box.min.z };
+                Point3D back = { p.n.x >= 0 ? n.box.min.x : n.box.max.x, p.n.y >= 0 ? n.box.min.y : n.box.max.y, p.n.z >= 0 ? n.box.min.z : n.box.max.z };
+                if (p.distance(front) < 0) outside = true;
+                else if (p.distance(back) >= 0) e.planes &= ~(1 << i);
+            }
+            if (outside) continue;
+            if (n.child[0] < 0) {
+                visit(n.item);
+            } else {
+                stack[top++] = { n.child[1], e.planes };
+                stack[top++] = { n.child[0], e.planes };
+            }
+        }
+    }
+
+    template <typename Hit>
+    float raycast(Point3D origin, Vec3 dir, float max_t, Hit &&hit) const {
+        /*
+         * hit(item) tests item and returns the distance along dir of the
+         * closest hit so far, earlier items included. Subtrees are visited
+         * nearest first and skipped once they start behind that hit.
+         * Returns the distance of the closest hit, max_t if there is none.
+         */
+        Vec3 inverse_dir = { 1 / dir.x, 1 / dir.y, 1 / dir.z };
+        struct Entry { int node; float t; };
+        Entry stack[BVH_STACK_SIZE];
+        int top = 0;
+        float t;
+        if (m_root < 0 || !m_nodes[m_root].box.intersect_ray(origin, inverse_dir, max_t, t)) return max_t;
+        stack[top++] = { m_root, t };
+        while (top) {
+            Entry e = stack[--top];
+            if (e.t >= max_t) continue;
+            const Node &n = m_nodes[e.node];
+            if (n.child[0] < 0) {
+                max_t = std::min(max_t, hit(n.item));
+                continue;
+            }
+            Entry a = { n.child[0], 0 }, b = { n.child[1], 0 };
+            bool hit_a = m_nodes[a.node].box.intersect_ray(origin, inverse_dir, max_t, a.t);
+            bool hit_b = m_nodes[b.node].box.intersect_ray(origin, inverse_dir, max_t, b.t);
+            if (hit_a && hit_b) {
+                // the nearer one on top
+                if (a.t < b.t) std::swap(a, b);
+                stack[top++] = a;
+                stack[top++] = b;
+            } else if (hit_a) {
+                stack[top++] = a;
+            } else if (hit_b) {
+                stack[top++] = b;
+            }
+        }
+        return max_t;
+    }
+
+private:
+    struct Node {
+        Box box;
+        int parent;   // next free node while on the free list
+        int child[2]; // -1 for leaves
+        int height;   // 0 for leaves
+        int item;
+    };
+
+    std::vector<Node> m_nodes;
+    int m_root = -1;
+    int m_free = -1;
+    int m_leaves = 0;
+
+    int allocate() {
+        if (m_free < 0) {
+            m_nodes.push_back({});
+            return m_nodes.size() - 1;
+        }
+        int index = m_free;
+        m_free = m_nodes[index].parent;
+        return index;
+    }
+
+    void release(int index) {
+        m_nodes[index].parent = m_free;
+        m_free = index;
+    }
+
+    void insert_leaf(int leaf) {
+        ++m_leaves;
+        if (m_root < 0) {
+            m_root = leaf;
+            m_nodes[leaf].parent = -1;
+            return;
+        }
+
+        /*
+         * walk down to the cheapest sibling: pairing the leaf with a node
+         * costs the area of their new parent, and every ancestor on the way
+         * grows by as much as its box has to
+         */
+        Box box = m_nodes[leaf].box;
+        int sibling = m_root;
+        while (m_nodes[sibling].child[0] >= 0) {
+            const Node &n = m_nodes[sibling];
+            float combined = n.box.merged(box).area();
+            float cost = 2 * combined;
+            float inherited = 2 * (combined - n.box.area());
+            float child_cost[2];
+            for (int i = 0; i < 2; ++i) {
+                const Node &c = m_nodes[n.child[i]];
+                float grown = c.box.merged(box).area();
+                child_cost[i] = (c.child[0] < 0 ? grown : grown - c.box.area()) + inherited;
+            }
+            if (cost < child_cost[0] && cost < child_cost[1]) break;
+            sibling = n.child[child_cost[0] < child_cost[1] ? 0 : 1];
+        }
+
+        int old_parent = m_nodes[sibling].parent;
+        int parent = allocate();
+        Node &p = m_nodes[parent];
+        p.parent = old_parent;
+        p.child[0] = sibling;
+        p.child[1] = leaf;
+        p.item = -1;
+        replace_child(old_parent, sibling, parent);
+        m_nodes[sibling].parent = parent;
+        m_nodes[leaf].parent = parent;
+        refit(parent);
+    }
+
+    void remove_leaf(int leaf) {
+        --m_leaves;
+        if (leaf == m_root) {
+            m_root = -1;
+            return;
+        }
+        // the sibling takes the place of the parent
+        int parent = m_nodes[leaf].parent;
+        int grandparent = m_nodes[parent].parent;
+        int sibling = m_nodes[parent].child[m_nodes[parent].child[0] == leaf ? 1 : 0];
+        replace_child(grandparent, parent, sibling);
+        m_nodes[sibling].parent = grandparent;
+        release(parent);
+        refit(grandparent);
+    }
+
+    void replace_child(int parent, int old_child, int new_child) {
+        if (parent < 0) {
+            m_root = new_child;
+        } else {
+            Node &p = m_nodes[parent];
+            p.child[p.child[0] == old_child ? 0 : 1] = new_child;
+        }
+    }
+
+    void update(int index) {
+        Node &n = m_nodes[index];
+        const Node &a = m_nodes[n.child[0]], &b = m_nodes[n.child[1]];
+        n.box = a.box.merged(b.box);
+        n.height = 1 + std::max(a.height, b.height);
+    }
+
+    void refit(int index) {
+        /* rebalances and recomputes the boxes from index up to the root */
+        while (index >= 0) {
+            index = rotate(index);
+            update(index);
+            index = m_nodes[index].parent;
+        }
+    }
+
+    int rotate(int index) {
+        /*
+         * if one child of index is more than one level taller than the
+         * other, lifts it into index's place: it keeps its taller child and
+         * hands the shorter one down to index. Returns the node now in
+         * index's place.
+         */
+        Node &a = m_nodes[index];
+        if (a.child[0] < 0) return index;
+        int balance = m_nodes[a.child[1]].height - m_nodes[a.child[0]].height;
+        if (balance >= -1 && balance <= 1) return index;
+        int side = balance > 0 ? 1 : 0;
+        int lifted = a.child[side];
+        Node &c = m_nodes[lifted];
+        int keep = m_nodes[c.child[0]].height > m_nodes[c.child[1]].height ? 0 : 1;
+        int handed = c.child[1 - keep];
+
+        a.child[side] = handed;
+        m_nodes[handed].parent = index;
+        c.child[1 - keep] = index;
+        c.parent = a.parent;
+        a.parent = lifted;
+        replace_child(c.parent, index, lifted);
+        update(index);
+        update(lifted);
+        return lifted;
+    }
+};
+
+/******************** Mesh geometry and cache *******************************/
+
+struct Mesh_cache_header {
+    /*
+     * Binary mesh cache written next to the OBJ file as <file>.dddmesh:
+     *   header | vertices (Point3D * vertex_count)
+     *          | indices (int * 3 * triangle_count)
+     *          | face normals (Vec3 * triangle_count)
+     *          | zeros up to a multiple of MESH_CACHE_STREAM_ALIGNMENT
+     *          | vertex streams x, y, z (float * padded vertex_count each)
+     *          | face streams x, y, z, d (float * padded triangle_count each)
+     * The levels of detail of a mesh are cached the same way as
+     * <file>.lod<level>.dddmesh. A cache is only used while the size and
+     * mtime of the source still match, and a level of detail only while it
+     * was made by the same SIMPLIFIER_VERSION for the same share of the
+     * triangles.
+     */
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t source_size;
+    int64_t source_mtime_ns;
+    uint32_t vertex_count;
+    uint32_t triangle_count;
+    Vec3 bounds_min;
+    Vec3 bounds_max;
+    uint32_t simplifier_version; // 0 for the full mesh
+    float lod_ratio;             // share of the full mesh's triangles asked for, 1 for the full mesh
+};
+
+#define MESH_CACHE_MAGIC "DDDMESH"
+#define MESH_CACHE_VERSION 3
+#define MESH_CACHE_STREAM_ALIGNMENT 32
+
+struct Geometry {
+    /*
+     * Unique vertices, three indices per triangle, one object-space normal
+     * per triangle and the bounding box. The arrays either live in the
+     * vectors below or point straight into a read-only mapping of the
+     * cache file, so a cached mesh is used without parsing or copying.
+     * The vertices and the triangle planes are also kept as padded
+     * structure-of-arrays streams for the vertex kernels, which the cache
+     * holds as well.
+     */
+
+    const Point3D *vertices = nullptr;
+    const int *indices = nullptr;
+    const Vec3 *normals = nullptr;
+    int vertex_count = 0;
+    int triangle_count = 0;
+    Vec3 bounds_min = { 0, 0, 0 };
+    Vec3 bounds_max = { 0, 0, 0 };
+    Vertex_streams vertex_streams;
+    Face_streams face_streams;
+
+    Geometry() = default;
+    Geometry(const Geometry &) = delete;
+    Geometry &operator=(const Geometry &) = delete;
+
+    void load(const std::string &filepath) {
+        struct stat source;
+        if (stat(filepath.c_str(), &source) == 0 && map_cache(filepath + ".dddmesh", source)) return;
+        std::vector<Point3D> parsed_vertices;
+        std::vector<int> parsed_indices;
+        if (!load_obj(filepath, parsed_vertices, parsed_indices)) return;
+        assign(std::move(parsed_vertices), std::move(parsed_indices));
+        if (stat(filepath.c_str(), &source) == 0) {
+            write_cache(filepath + ".dddmesh", source);
+        }
+    }
+
+    static bool cached_bounds(const std::string &filepath, Box &box) {
+        /* the bounds from an up to date cache header, without loading anything else */
+        struct stat source;
+        if (stat(filepath.c_str(), &source) != 0) return false;
+        FILE *f = fopen((filepath + ".dddmesh").c_str(), "rb");
+        if (!f) return false;
+        Mesh_cache_header header;
+        bool ok = fread(&header, sizeof header, 1, f) == 1 && header_matches(header, source);
+        fclose(f);
+        if (ok) box = { header.bounds_min, header.bounds_max };
+        return ok;
+    }
+
+    void load_lod(const std::string &filepath, int level, const Geometry &full, float ratio) {
+        /* full, the geometry loaded from filepath, simplified to ratio of its triangles, cached as <file>.lod<level>.dddmesh */
+        std::string cache_path = filepath + ".lod" + std::to_string(level) + ".dddmesh";
+        struct stat source;
+        bool have_source = stat(filepath.c_str(), &source) == 0;
+        if (have_source && map_cache(cache_path, source, ratio)) return;
+        int target_triangles = full.triangle_count * ratio;
+        auto start = std::chrono::steady_clock::now();
+        std::vector<Point3D> simplified_vertices;
+        std::vector<int> simplified_indices;
+        simplify_mesh(full.vertices, full.vertex_count, full.indices, full.triangle_count, target_triangles,
+                      simplified_vertices, simplified_indices);
+        assign(std::move(simplified_vertices), std::move(simplified_indices));
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        SDL_Log("Simplified %s to %d triangles (level %d) in %.2f ms", filepath.c_str(), triangle_count, level, seconds * 1000);
+        if (have_source) {
+            write_cache(cache_path, source, ratio);
+        }
+    }
+
+    void assign(std::vector<Point3D> &&new_vertices, std::vector<int> &&new_indices) {
+        /* take over generated or parsed vertex and index arrays */
+        m_vertex_storage = std::move(new_vertices);
+        m_index_storage = std::move(new_indices);
+        m_normal_storage.resize(m_index_storage.size() / 3);
+        m_mapping.reset();
+        vertices = m_vertex_storage.data();
+        indices = m_index_storage.data();
+        normals = m_normal_storage.data();
+        vertex_count = m_vertex_storage.size();
+        triangle_count = m_normal_storage.size();
+        update_normals();
+        update_bounds();
+        update_streams();
+    }
+
+    void update_normals() {
+        for (int i = 0; i < triangle_count; ++i) {
+            const int *index = &indices[i * 3];
+            Vec3 n = (vertices[index[1]] - vertices[index[0]]).cross(vertices[index[2]] - vertices[index[0]]);
+            // degenerate triangles get a zero normal, which back-face culling rejects
+            m_normal_storage[i] = n.dot(n) > 0 ? n.normalise() : Vec3{ 0, 0, 0 };
+        }
+    }
+
+    void update_bounds() {
+        if (vertex_count == 0) return;
+        bounds_min = bounds_max = vertices[0];
+        for (int i = 1; i < vertex_count; ++i) {
+            bounds_min = { std::min(bounds_min.x, vertices[i].x), std::min(bounds_min.y, vertices[i].y), std::min(bounds_min.z, vertices[i].z) };
+            bounds_max = { std::max(bounds_max.x, vertices[i].x), std::max(bounds_max.y, vertices[i].y), std::max(bounds_max.z, vertices[i].z) };
+        }
+    }
+
+    void update_streams() {
+        /* zero padding makes the padded vertices land on the origin and the padded triangles face away */
+        int padded_vertices = simd_padded(vertex_count), padded_triangles = simd_padded(triangle_count);
+        m_stream_storage.assign(stream_size(vertex_count, triangle_count), 0.0f);
+        float *x = m_stream_storage.data(), *y = x + padded_vertices, *z = y + padded_vertices;
+        for (int i = 0; i < vertex_count; ++i) {
+            x[i] = vertices[i].x;
+            y[i] = vertices[i].y;
+            z[i] = vertices[i].z;
+        }
+        float *nx = z + padded_vertices, *ny = nx + padded_triangles, *nz = ny + padded_triangles, *d = nz + padded_triangles;
+        for (int i = 0; i < triangle_count; ++i) {
+            Vec3 n = normals[i];
+            nx[i] = n.x;
+            ny[i] = n.y;
+            nz[i] = n.z;
+            d[i] = -n.dot(vertices[indices[i * 3]]);
+        }
+        set_streams(m_stream_storage.data());
+    }
+
+private:
+    std::vector<Point3D> m_vertex_storage;
+    std::vector<int> m_index_storage;
+    std::vector<Vec3> m_normal_storage;
+    std::vector<float> m_stream_storage;
+    std::unique_ptr<Mapped_file> m_mapping;
+
+    static int64_t mtime_ns(const struct stat &st) {
+        return (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    }
+
+    static uint32_t simplifier_version(float lod_ratio) {
+        return lod_ratio < 1 ? SIMPLIFIER_VERSION : 0;
+    }
+
+    static bool header_matches(const Mesh_cache_header &header, const struct stat &source, float lod_ratio = 1) {
+        return memcmp(header.magic, MESH_CACHE_MAGIC, sizeof MESH_CACHE_MAGIC) == 0
+            && header.version == MESH_CACHE_VERSION
+            && header.header_size == sizeof(Mesh_cache_header)
+            && header.source_size == (uint64_t) source.st_size
+            && header.source_mtime_ns == mtime_ns(source)
+            && header.simplifier_version == simplifier_version(lod_ratio)
+            && header.lod_ratio == lod_ratio;
+    }
+
+    static size_t stream_size(int vertex_count, int triangle_count) {
+        /* in floats */
+        return 3 * (size_t) simd_padded(vertex_count) + 4 * (size_t) simd_padded(triangle_count);
+    }
+
+    void set_streams(const float *p) {
+        /* the vertex and face streams laid out one after the other from p */
+        int padded_vertices = simd_padded(vertex_count), padded_triangles = simd_padded(triangle_count);
+        vertex_streams = { p, p + padded_vertices, p + 2 * padded_vertices };
+        p += 3 * padded_vertices;
+        face_streams = { p, p + padded_triangles, p + 2 * padded_triangles, p + 3 * padded_triangles };
+    }
+
+    static size_t arrays_end(uint32_t vertex_count, uint32_t triangle_count) {
+        return sizeof(Mesh_cache_header) + vertex_count * sizeof(Point3D) + triangle_count * (3 * sizeof(int) + sizeof(Vec3));
+    }
+
+    static size_t stream_offset(uint32_t vertex_count, uint32_t triangle_count) {
+        size_t end = arrays_end(vertex_count, triangle_count);
+        return (end + MESH_CACHE_STREAM_ALIGNMENT - 1) / MESH_CACHE_STREAM_ALIGNMENT * MESH_CACHE_STREAM_ALIGNMENT;
+    }
+
+    static size_t cache_size(uint32_t vertex_count, uint32_t triangle_count) {
+        return stream_offset(vertex_count, triangle_count) + stream_size(vertex_count, triangle_count) * sizeof(float);
+    }
+
+    bool map_cache(const std::string &cache_path, const struct stat &source, float lod_ratio = 1) {
+        auto start = std::chrono::steady_clock::now();
+        auto mapping = std::make_unique<Mapped_file>(cache_path, false);
+        if (!mapping->is_open() || mapping->size() < sizeof(Mesh_cache_header)) return false;
+
+        Mesh_cache_header header;
+        memcpy(&header, mapping->data(), sizeof header);
+        if (!header_matches(header, source, lod_ratio) || mapping->size() != cache_size(header.vertex_count, header.triangle_count)) {
+            return false; // stale or foreign, rebuilt from the OBJ
+        }
+
+        const char *p = mapping->data() + sizeof(Mesh_cache_header);
+        vertices = (const Point3D *) p;
+        p += header.vertex_count * sizeof(Point3D);
+        indices = (const int *) p;
+        p += header.triangle_count * 3 * sizeof(int);
+        normals = (const Vec3 *) p;
+        vertex_count = header.vertex_count;
+        triangle_count = header.triangle_count;
+        bounds_min = header.bounds_min;
+        bounds_max = header.bounds_max;
+        set_streams((const float *) (mapping->data() + stream_offset(header.vertex_count, header.triangle_count)));
+        m_mapping = std::move(mapping);
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        SDL_Log("Mapped %s: %d vertices, %d triangles in %.2f ms", cache_path.c_str(), vertex_count, triangle_count, seconds * 1000);
+        return true;
+    }
+
+    void write_cache(const std::string &cache_path, const struct stat &source, float lod_ratio = 1) {
+        Mesh_cache_header header = {};
+        memcpy(header.magic, MESH_CACHE_MAGIC, sizeof MESH_CACHE_MAGIC);
+        header.version = MESH_CACHE_VERSION;
+        header.header_size = sizeof(Mesh_cache_header);
+        header.source_size = source.st_size;
+        header.source_mtime_ns = mtime_ns(source);
+        header.vertex_count = vertex_count;
+        header.triangle_count = triangle_count;
+        header.bounds_min = bounds_min;
+        header.bounds_max = bounds_max;
+        header.simplifier_version = simplifier_version(lod_ratio);
+        header.lod_ratio = lod_ratio;
+
+        // write to a temporary file and rename it, so a reader never sees a partial cache
+        std::string tmp_path = cache_path + ".tmp";
+        FILE *f = fopen(tmp_path.c_str(), "wb");
+        if (!f) {
+            std::cerr << "Warning: could not write mesh cache " << cache_path << '\n';
+            return;
+        }
+        bool ok = fwrite(&header, sizeof header, 1, f) == 1
+               && fwrite(vertices, sizeof(Point3D), vertex_count, f) == (size_t) vertex_count
+               && fwrite(indices, 3 * sizeof(int), triangle_count, f) == (size_t) triangle_count
+               && fwrite(normals, sizeof(Vec3), triangle_count, f) == (size_t) triangle_count;
+        static const char zeros[MESH_CACHE_STREAM_ALIGNMENT] = {};
+        size_t padding = stream_offset(vertex_count, triangle_count) - arrays_end(vertex_count, triangle_count);
+        size_t floats = stream_size(vertex_count, triangle_count);
+        ok = ok && fwrite(zeros, 1, padding, f) == padding
+                && fwrite(vertex_streams.x, sizeof(float), floats, f) == floats;
+        ok = fclose(f) == 0 && ok;
+        if (!ok || rename(tmp_path.c_str(), cache_path.c_str()) != 0) {
+            std::cerr << "Warning: could not write mesh cache " << cache_path << '\n';
+            unlink(tmp_path.c_str());
+        }
+    }
+};
+
+// at most this many triangles in a leaf of a Triangle_bvh
+#define BVH_LEAF_TRIANGLES 4
+
+struct Triangle_bvh {
+    /*
+     * Static bounding volume hierarchy over the triangles of one geometry,
+     * built once by splitting at the median centroid along the longest
+     * axis, for ray queries in object space.
+     */
+
+    void build(const Geometry &geometry) {
+        m_nodes.clear();
+        m_triangles.resize(geometry.triangle_count);
+        std::vector<Point3D> centroids(geometry.triangle_count);
+        for (int i = 0; i < geometry.triangle_count; ++i) {
+            const int *index = &geometry.indices[i * 3];
+            m_triangles[i] = i;
+            centroids[i] = (geometry.vertices[index[0]] + geometry.vertices[index[1]] + geometry.vertices[index[2]]) * (1.0f / 3);
+        }
+        if (geometry.triangle_count) build(geometry, centroids, 0, geometry.triangle_count);
+    }
+
+    bool raycast(const Geometry &geometry, Point3D origin, Vec3 dir, float &t, int &triangle) const {
+        /* lowers t to the closest triangle hit from either side before it, returns false if there is none */
+        if (m_nodes.empty()) return false;
+        Vec3 inverse_dir = { 1 / dir.x, 1 / dir.y, 1 / dir.z };
+        int stack[BVH_STACK_SIZE];
+        int top = 0;
+        stack[top++] = 0;
+        bool found = false;
+        while (top) {
+            const Node &n = m_nodes[stack[--top]];
+            float enter;
+            if (!n.box.intersect_ray(origin, inverse_dir, t, enter)) continue;
+            if (n.count == 0) {
+                // the left child follows its parent
+                stack[top++] = n.right;
+                stack[top++] = &n - &m_nodes[0] + 1;
+                continue;
+            }
+            for (int i = n.first; i < n.first + n.count; ++i) {
+                // Moller-Trumbore
+                const int *index = &geometry.indices[m_triangles[i] * 3];
+                Point3D a = geometry.vertices[index[0]];
+                Vec3 e1 = geometry.vertices[index[1]] - a, e2 = geometry.vertices[index[2]] - a;
+                Vec3 p = dir.cross(e2);
+                float det = e1.dot(p);
+                if (fabsf(det) < 1e-12f) continue;
+                float inverse_det = 1 / det;
+                Vec3 s = origin - a;
+                float u = s.dot(p) * inverse_det;
+                if (u < 0 || u > 1) continue;
+                Vec3 q = s.cross(e1);
+                float v = dir.dot(q) * inverse_det;
+                if (v < 0 || u + v > 1) continue;
+                float d = e2.dot(q) * inverse_det;
+                if (d > 0 && d < t) {
+                    t = d;
+                    triangle = m_triangles[i];
+                    found = true;
+                }
+            }
+        }
+        return found;
+    }
+
+private:
+    struct Node {
+        Box box;
+        int first; // leaves hold m_triangles[first .. first + count)
+        int count; // 0 for inner nodes
+        int right; // inner nodes only
+    };
+
+    std::vector<Node> m_nodes;
+    std::vector<int> m_triangles;
+
+    void build(const Geometry &geometry, const std::vector<Point3D> &centroids, int first, int count) {
+        int index = m_nodes.size();
+        m_nodes.push_back({});
+        Box box = { geometry.vertices[geometry.indices[m_triangles[first] * 3]], geometry.vertices[geometry.indices[m_triangles[first] * 3]] };
+        Box centroid_box = { centroids[m_triangles[first]], centroids[m_triangles[first]] };
+        for (int i = first; i < first + count; ++i) {
+            for (int j = 0; j < 3; ++j) {
+                Point3D p = geometry.vertices[geometry.indices[m_triangles[i] * 3 + j]];
+                box = box.merged({ p, p });
+            }
+            centroid_box = centroid_box.merged({ centroids[m_triangles[i]], centroids[m_triangles[i]] });
+        }
+        m_nodes[index].box = box;
+        if (count <= BVH_LEAF_TRIANGLES) {
+            m_nodes[index].first = first;
+            m_nodes[index].count = count;
+            return;
+        }
+
+        Vec3 extent = centroid_box.max - centroid_box.min;
+        float Point3D::*axis = extent.x >= extent.y && extent.x >= extent.z ? &Point3D::x : extent.y >= extent.z ? &Point3D::y : &Point3D::z;
+        int half = count / 2;
+        std::nth_element(m_triangles.begin() + first, m_triangles.begin() + first + half, m_triangles.begin() + first + count,
+                         [&](int a, int b) { return centroids[a].*axis < centroids[b].*axis; });
+        build(geometry, centroids, first, half);
+        m_nodes[index].right = m_nodes.size();
+        m_nodes[index].count = 0;
+        build(geometry, centroids, first + half, count - half);
+    }
+};
+
+/****************************************************************************/
+
+class Drawable;
+class Scene;
+
+struct Ray_hit {
+    float t;          // distance along the normalised ray direction
+    Point3D point;
+    Vec3 normal;      // of the surface hit, facing the ray
+    Drawable *drawable;
+};
+
+class Drawable {
+public:
+    virtual ~Drawable();
+    void draw(SDL_Renderer *renderer, Player &player) {
+        PROFILE_SCOPE(name());
+        Box box;
+        if (active && (!get_bounds(box) || (player.sees(box) && !g_occlusion.occludes(box))))
+            draw_impl(renderer, player);
+    }
+    bool switch_activation() {
+        return active = !active;
+    }
+    virtual const char *name() = 0;
+    // lowers hit.t and sets hit.normal if the ray from origin along the unit vector dir hits closer than hit.t
+    virtual bool raycast(Point3D origin, Vec3 dir, Ray_hit &hit) { return false; }
+protected:
+    bool active = true;
+    // has to be called whenever get_bounds() changes, so the scene can refit
+    void bounds_changed();
+private:
+    virtual void draw_impl(SDL_Renderer *renderer, Player &player) = 0;
+    // world-space bounds for frustum culling, drawables without bounds are always drawn
+    virtual bool get_bounds(Box &box) { return false; }
+    // solid surfaces go into g_occlusion, before anything is drawn
+    virtual void draw_occluders(Player &player) { }
+
+    friend class Scene;
+    Scene *m_scene = nullptr;
+    int m_scene_slot = -1;
+    int m_scene_proxy = -1; // leaf in the scene's tree, -1 while without bounds
+};
+
+void draw_wireframe_box(const Box &box, const Mat4 &model, uint32_t color, Player &player) {
+    /* the edges of box transformed by model, clipped to the view */
+    Mat4 model_view = player.m_view * model;
+    Point3D cam[8];
+    Point2D pts[8];
+    int any_outside = 0;
+    Vec3 center = (box.min + box.max) * 0.5f, size = box.max - box.min;
+    for (int i = 0; i < 8; ++i) {
+        Point3D corner = { center.x + cube_points[i].x * size.x, center.y + cube_points[i].y * size.y, center.z + cube_points[i].z * size.z };
+        cam[i] = model_view.transform_affine(corner);
+        pts[i] = place_projected_point(project(cam[i]));
+        any_outside |= outcode(cam[i], player.m_clip_planes);
+    }
+
+    for (auto &e: cube_edges) {
+        Point3D a = cam[e[0]], b = cam[e[1]];
+        Point2D pa = pts[e[0]], pb = pts[e[1]];
+        if (any_outside) {
+            // cut off whatever is outside the view
+            if (!clip_segment(a, b, player.m_clip_planes)) continue;
+            pa = place_projected_point(project(a));
+            pb = place_projected_point(project(b));
+        }
+        if (g_backend == BACKEND_SOFTWARE) {
+            g_rasterizer.draw_line({pa.x, pa.y, inverse_depth(a.z)}, {pb.x, pb.y, inverse_depth(b.z)}, color);
+        } else {
+            g_line_batch.add(pa, pb, color);
+        }
+    }
+}
+
+struct Cube_set : Drawable {
+    /*
+     * Wireframe cubes kept packed in parallel arrays: bounds, colors and
+     * active flags, with no gaps. Removing one moves the last cube into its
+     * place. A tree of their bounds keyed by handle culls and picks them,
+     * and all the cubes are drawn by one call. Handles stay valid until the
+     * cube is removed.
+     */
+
+    int add(Point3D pos, float scale, uint32_t color = COLOR_RED) {
+        /*
+         * pos   - position of the center of the cube
+         * scale - the size of the cube
+         *
+         */
+        Vec3 half = { scale * 0.5f, scale * 0.5f, scale * 0.5f };
+        Box box = { pos - half, pos + half };
+        int handle;
+        if (!m_free.empty()) {
+            handle = m_free.back();
+            m_free.pop_back();
+        } else {
+            handle = m_index.size();
+            m_index.push_back(-1);
+        }
+        m_index[handle] = m_bounds.size();
+        m_bounds.push_back(box);
+        m_colors.push_back(color);
+        m_active.push_back(true);
+        m_handles.push_back(handle);
+        m_proxies.push_back(m_tree.insert(box, handle));
+        bounds_changed();
+        return handle;
+    }
+
+    void remove(int handle) {
+        /* the last cube fills the gap */
+        int i = m_index[handle], last = m_bounds.size() - 1;
+        m_tree.remove(m_proxies[i]);
+        m_bounds[i] = m_bounds[last];
+        m_colors[i] = m_colors[last];
+        m_active[i] = m_active[last];
+        m_handles[i] = m_handles[last];
+        m_proxies[i] = m_proxies[last];
+        m_index[m_handles[i]] = i;
+        m_bounds.pop_back();
+        m_colors.pop_back();
+        m_active.pop_back();
+        m_handles.pop_back();
+        m_proxies.pop_back();
+        m_index[handle] = -1;
+        m_free.push_back(handle);
+        bounds_changed();
+    }
+
+    void move(int handle, Vec3 offset) {
+        int i = m_index[handle];
+        Box &box = m_bounds[i];
+        box = { box.min + offset, box.max + offset };
+        if (m_tree.move(m_proxies[i], box)) bounds_changed();
+    }
+
+    Point3D position(int handle) {
+        const Box &box = m_bounds[m_index[handle]];
+        return (box.min + box.max) * 0.5f;
+    }
+
+    float scale(int handle) {
+        const Box &box = m_bounds[m_index[handle]];
+        return box.max.x - box.min.x;
+    }
+
+    bool switch_activation(int handle) {
+        uint8_t &active = m_active[m_index[handle]];
+        active = !active;
+        return active;
+    }
+
+    int count() {
+        return m_bounds.size();
+    }
+
+    void draw_impl(SDL_Renderer *renderer, Player &player) {
+        m_visible.clear();
+        {
+            PROFILE_SCOPE("culling");
+            m_tree.query_frustum(player.m_frustum, CLIP_PLANE_COUNT, [&](int handle) {
+                int i = m_index[handle];
+                if (m_active[i]) m_visible.push_back(i);
+            });
+            // back in array order, so the draw walks the arrays forward
+            std::sort(m_visible.begin(), m_visible.end());
+        }
+        for (int i: m_visible) {
+            if (!g_occlusion.occludes(m_bounds[i])) draw_wireframe_box(m_bounds[i], Mat4::identity(), m_colors[i], player);
+        }
+    }
+
+    bool raycast(Point3D origin, Vec3 dir, Ray_hit &hit) {
+        Vec3 inverse_dir = { 1 / dir.x, 1 / dir.y, 1 / dir.z };
+        int closest = -1;
+        m_tree.raycast(origin, dir, hit.t, [&](int handle) {
+            int i = m_index[handle];
+            float t;
+            if (m_active[i] && m_bounds[i].intersect_ray(origin, inverse_dir, hit.t, t)) {
+                hit.t = t;
+                closest = i;
+            }
+            return hit.t;
+        });
+        if (closest < 0) return false;
+        // the face entered through is the one the hit point sticks out of the most
+        const Box &box = m_bounds[closest];
+        Vec3 d = origin + dir * hit.t - (box.min + box.max) * 0.5f;
+        float a[3] = { fabsf(d.x), fabsf(d.y), fabsf(d.z) };
+        int axis = a[0] >= a[1] && a[0] >= a[2] ? 0 : a[1] >= a[2] ? 1 : 2;
+        hit.normal = { axis == 0 ? copysignf(1, d.x) : 0, axis == 1 ? copysignf(1, d.y) : 0, axis == 2 ? copysignf(1, d.z) : 0 };
+        return true;
+    }
+
+    const char *name() {
+        return "Cube_set";
+    }
+
+private:
+    // by position in the arrays
+    std::vector<Box> m_bounds;
+    std::vector<uint32_t> m_colors;
+    std::vector<uint8_t> m_active;
+    std::vector<int> m_handles;
+    std::vector<int> m_proxies;
+    // by handle, -1 for free handles
+    std::vector<int> m_index;
+    std::vector<int> m_free;
+    Aabb_tree m_tree;          // of handles
+
+    Frame_array<int> m_visible; // array positions
+
+    bool get_bounds(Box &box) {
+        return m_tree.bounds(box);
+    }
+};
+
+struct Cube {
+    /*
+     * A wireframe cube; the bounds and color live in a Cube_set shared
+     * with other cubes, which draws it.
+     */
+
+    Cube(Cube_set &set, Point3D pos, float scale, uint32_t color = COLOR_RED) : m_set(set) {
+        m_handle = m_set.add(pos, scale, color);
+    }
+
+    ~Cube() {
+        m_set.remove(m_handle);
+    }
+
+    Cube(const Cube &) = delete;
+    Cube &operator=(const Cube &) = delete;
+
+    void move(float x, float y = 0, float z = 0) {
+        m_set.move(m_handle, { x, y, z });
+    }
+
+    Point3D getpos() {
+        return m_set.position(m_handle);
+    }
+
+    float get_top() {
+        return getpos().y - m_set.scale(m_handle) * 0.5f;
+    }
+
+    bool switch_activation() {
+        return m_set.switch_activation(m_handle);
+    }
+
+private:
+    Cube_set &m_set;
+    int m_handle;
+};
+
+#define LOD_COUNT 4
+// share of the full mesh's triangles kept by each level of detail
+const float LOD_RATIOS[LOD_COUNT] = { 1.0f, 0.5f, 0.25f, 0.1f };
+// a level is used down to this projected bounding sphere diameter in pixels
+const float LOD_MIN_PIXELS[LOD_COUNT] = { 400, 200, 80, 0 };
+// how far past a threshold the size has to go before the level changes
+#define LOD_HYSTERESIS 0.15f
+// no level is generated with fewer triangles than this
+#define LOD_MIN_TRIANGLES 32
+
+inline SDL_Color shade(uint32_t color, float light) {
+    /* scales the rgb part of a 0xRRGGBBAA color */
+    light = std::clamp(light, 0.0f, 1.0f);
+    return { (uint8_t) ((color >> 3 * 8) * light), (uint8_t) ((color >> 2 * 8 & 0xFF) * light),
+             (uint8_t) ((color >> 8 & 0xFF) * light), (uint8_t) (color & 0xFF) };
+}
+
+struct Mesh_asset {
+    /*
+     * Object-space geometry with its levels of detail, the full mesh first.
+     * Assets loaded from a file are shared by everything that draws that
+     * file and are filled in on the loader threads, see load_mesh_asset().
+     * Nothing but placeholder may be touched before ready() returns true;
+     * from then on the asset never changes.
+     */
+    Geometry lods[LOD_COUNT];
+    int lod_count = 1;
+    // over the full mesh, for picking
+    Triangle_bvh bvh;
+    // drawn as a wireframe while loading, the real bounds if a cache has them
+    Box placeholder = { { -0.5f, -0.5f, -0.5f }, { 0.5f, 0.5f, 0.5f } };
+
+    bool ready() const {
+        return m_ready.load(std::memory_order_acquire);
+    }
+
+    void wait() const {
+        /* blocks until the asset is loaded, for code that needs it right away */
+        if (m_loading.valid()) m_loading.wait();
+    }
+
+    void set_ready() {
+        m_ready.store(true, std::memory_order_release);
+    }
+
+    void set_loading(std::shared_future<void> loading) {
+        m_loading = loading;
+    }
+
+    void load(const std::string &filepath) {
+        /*
+         * from an obj file, or from its binary cache if it is up to date,
+         * with simplified levels of detail that are cached the same way
+         */
+        Geometry &full = lods[0];
+        full.load(filepath);
+        while (lod_count < LOD_COUNT && full.triangle_count * LOD_RATIOS[lod_count] >= LOD_MIN_TRIANGLES) {
+            ++lod_count;
+        }
+        std::vector<std::future<void>> done;
+        for (int level = 1; level < lod_count; ++level) {
+            done.push_back(worker_pool().submit([this, &filepath, level] {
+                lods[level].load_lod(filepath, level, lods[0], LOD_RATIOS[level]);
+            }));
+        }
+        bvh.build(full);
+        for (auto &f: done) f.get();
+    }
+
+    Box bounds() const {
+        if (!ready()) return placeholder;
+        return { lods[0].bounds_min, lods[0].bounds_max };
+    }
+
+    int select_lod(const Mat4 &model_view, int current) const {
+        /* picks the level from the projected size of the bounding sphere, staying at the current one near a threshold */
+        const Geometry &full = lods[0];
+        Vec3 half = (full.bounds_max - full.bounds_min) * 0.5f;
+        float radius = sqrtf(half.dot(half));
+        Point3D center = model_view.transform_affine(full.bounds_min + half);
+        float distance = sqrtf(center.dot(center));
+        if (distance <= radius) return 0;
+        float pixels = 2 * radius / (distance * tana2) * render_width;
+        int level = 0;
+        while (level + 1 < lod_count && pixels < LOD_MIN_PIXELS[level] * (level < current ? 1 + LOD_HYSTERESIS : 1 - LOD_HYSTERESIS)) {
+            ++level;
+        }
+        return level;
+    }
+
+    bool raycast(const Mat4 &model, Point3D origin, Vec3 dir, Ray_hit &hit) const {
+        /* against the full mesh placed by model, which has to be rigid */
+        Mat4 inverse = model.inverse_rigid();
+        int triangle;
+        if (!bvh.raycast(lods[0], inverse.transform_affine(origin), inverse.transform_direction(dir), hit.t, triangle)) return false;
+        hit.normal = model.transform_direction(lods[0].normals[triangle]);
+        if (hit.normal.dot(dir) > 0) hit.normal = -hit.normal;
+        return true;
+    }
+
+private:
+    std::atomic<bool> m_ready{false};
+    std::shared_future<void> m_loading;
+};
+
+std::shared_ptr<const Mesh_asset> load_mesh_asset(const std::string &filepath) {
+    /*
+     * Every path is loaded once and shared for as long as anything holds on
+     * to it. The load runs on the loader threads and this returns right
+     * away; the render thread polls ready() without taking any lock.
+     */
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::weak_ptr<const Mesh_asset>> assets;
+    std::lock_guard<std::mutex> lock(mutex);
+    std::weak_ptr<const Mesh_asset> &entry = assets[filepath];
+    if (auto asset = entry.lock()) return asset;
+    auto asset = std::make_shared<Mesh_asset>();
+    Geometry::cached_bounds(filepath, asset->placeholder);
+    asset->set_loading(loader_pool().submit([asset, filepath]() mutable {
+        asset->load(filepath);
+        asset->set_ready();
+        // the asset keeps this task's future, so the task lets go of it once done
+        asset.reset();
+    }).share());
+    entry = asset;
+    return asset;
+}
+
+Camera_vertices camera_vertices(const Geometry &geometry, const Mat4 &model_view, Player &player) {
+    /* every unique vertex is transformed, classified and projected exactly once, into the frame arena */
+    PROFILE_SCOPE("transform");
+    int n = simd_padded(geometry.vertex_count);
+    Camera_vertices t;
+    t.camera = { g_frame_arena.alloc<float>(n), g_frame_arena.alloc<float>(n), g_frame_arena.alloc<float>(n) };
+    t.screen_x = g_frame_arena.alloc<float>(n);
+    t.screen_y = g_frame_arena.alloc<float>(n);
+    t.outcodes = g_frame_arena.alloc<int>(n);
+    transform_vertices(model_view, player.m_clip_planes, geometry.vertex_streams, geometry.vertex_count, t);
+    return t;
+}
+
+void collect_triangles(const Geometry &geometry, const Mat4 &model_view, uint32_t color, int64_t first_id, Player &player, Triangle_batch &batch) {
+    /* culls, shades and clips the triangles of geometry into batch, triangle i gets the id first_id + i */
+    Camera_vertices t = camera_vertices(geometry, model_view, player);
+
+    PROFILE_SCOPE("triangles");
+    // back-face test in object space against the camera position, model_view has to be rigid
+    const float (*m)[4] = model_view.m;
+    Point3D eye = { -(m[0][0] * m[0][3] + m[1][0] * m[1][3] + m[2][0] * m[2][3]),
+                    -(m[0][1] * m[0][3] + m[1][1] * m[1][3] + m[2][1] * m[2][3]),
+                    -(m[0][2] * m[0][3] + m[1][2] * m[1][3] + m[2][2] * m[2][3]) };
+    uint8_t *facing = g_frame_arena.alloc<uint8_t>(simd_padded(geometry.triangle_count));
+    facing_triangles(geometry.face_streams, eye, geometry.triangle_count, facing);
+
+    Point3D poly[MAX_CLIPPED_VERTICES];
+    Point2D pts[3];
+
+    Vec3 light_direction = { 0.0f, 0.0f, 1.0f };
+    light_direction.normalise();
+    Point3D normal;
+
+    for (int i = 0; i < geometry.triangle_count; ++i) {
+        if (!facing[i]) continue;
+        const int *index = &geometry.indices[i * 3];
+        int codes[3] = { t.outcodes[index[0]], t.outcodes[index[1]], t.outcodes[index[2]] };
+        // all three vertices outside the same plane
+        if (codes[0] & codes[1] & codes[2]) continue;
+
+        for (int j = 0; j < 3; ++j) {
+            int k = index[j];
+            poly[j] = { t.camera.x[k], t.camera.y[k], t.camera.z[k] };
+            pts[j] = { t.screen_x[k], t.screen_y[k] };
+        }
+        normal = model_view.transform_direction(geometry.normals[i]);
+
+        batch.add(poly, pts, codes[0] | codes[1] | codes[2], shade(color, -light_direction.dot(normal)), player.m_clip_planes, first_id + i);
+    }
+}
+
+struct Mesh : Drawable {
+
+    Mesh(std::string filepath) : m_asset(load_mesh_asset(filepath)) {
+        /*
+         * the geometry is shared with every other mesh or instance loaded
+         * from filepath, until it is loaded its bounding box is drawn instead
+         */
+    }
+
+    Mesh(std::vector<Point3D> &&vertices, std::vector<int> &&indices) {
+        /* create a mesh from generated geometry, three indices per triangle, without levels of detail */
+        auto asset = std::make_shared<Mesh_asset>();
+        asset->lods[0].assign(std::move(vertices), std::move(indices));
+        asset->bvh.build(asset->lods[0]);
+        asset->set_ready();
+        m_asset = asset;
+    }
+
+    void draw_impl(SDL_Renderer *renderer, Player &player) {
+        /* the object-space vertices go to camera space in one step, nothing is stored in world space */
+        if (!loaded()) {
+            draw_wireframe_box(m_asset->placeholder, m_model, COLOR_BEIGE, player);
+            return;
+        }
+        Mat4 model_view = player.m_view * m_model;
+        m_lod = m_asset->select_lod(model_view, m_lod);
+        m_batch.clear();
+        collect_triangles(m_asset->lods[m_lod], model_view, COLOR_WHITE, 0, player, m_batch);
+        m_batch.draw(renderer);
+    }
+
+    Box bounds() {
+        /* world-space bounds, only recomputed after the model transform changed or the geometry arrived */
+        if (m_model_dirty || !m_loaded) {
+            loaded();
+            m_bounds = m_asset->bounds().transformed(m_model);
+            m_model_dirty = false;
+        }
+        return m_bounds;
+    }
+
+    const char *name() {
+        return "Mesh";
+    }
+
+    bool get_bounds(Box &box) {
+        /* none while loading, the placeholder is cheap enough to always draw */
+        if (!loaded()) return false;
+        box = bounds();
+        return true;
+    }
+
+    bool raycast(Point3D origin, Vec3 dir, Ray_hit &hit) {
+        return loaded() && m_asset->raycast(m_model, origin, dir, hit);
+    }
+
+    void draw_occluders(Player &player) {
+        /* the front faces of the full mesh, if it is small enough */
+        if (!loaded() || m_asset->lods[0].triangle_count > OCCLUDER_MAX_MESH_TRIANGLES) return;
+        const Geometry &geometry = m_asset->lods[0];
+        Mat4 model_view = player.m_view * m_model;
+        Camera_vertices t = camera_vertices(geometry, model_view, player);
+        Point3D poly[MAX_CLIPPED_VERTICES];
+        for (int i = 0; i < geometry.triangle_count; ++i) {
+            const int *index = &geometry.indices[i * 3];
+            int codes[3] = { t.outcodes[index[0]], t.outcodes[index[1]], t.outcodes[index[2]] };
+            if (codes[0] & codes[1] & codes[2]) continue;
+            for (int j = 0; j < 3; ++j) {
+                poly[j] = { t.camera.x[index[j]], t.camera.y[index[j]], t.camera.z[index[j]] };
+            }
+            if (model_view.transform_direction(geometry.normals[i]).dot(poly[0]) >= 0) continue;
+            g_occlusion.add_occluder(poly, 3, codes[0] | codes[1] | codes[2]);
+        }
+    }
+
+    void translate(float x, float y, float z) {
+        transform(Mat4::translation({x, y, z}));
+    }
+
+    void rotate(float angle) {
+        transform(Mat4::rotation_y(angle));
+    }
+
+    void rotate_around_point(float angle, Point3D origin) {
+        transform(Mat4::rotation_y_around_point(angle, origin));
+    }
+
+    void transform(const Mat4 &matrix) {
+        /* applies matrix on top of the model transform, it has to be rigid for the normals to stay valid */
+        set_model(matrix * m_model);
+    }
+
+    void set_model(const Mat4 &model) {
+        m_model = model;
+        m_model_dirty = true;
+        bounds_changed();
+    }
+
+    const Mat4 &model() const {
+        return m_model;
+    }
+
+    void wait_until_loaded() {
+        m_asset->wait();
+    }
+
+private:
+    std::shared_ptr<const Mesh_asset> m_asset;
+    bool m_loaded = false;
+    int m_lod = 0;
+    Mat4 m_model = Mat4::identity();
+    bool m_model_dirty = true;
+    Box m_bounds;
+
+    Triangle_batch m_batch;
+
+    bool loaded() {
+        if (!m_loaded && m_asset->ready()) {
+            m_loaded = true;
+            m_model_dirty = true;
+        }
+        return m_loaded;
+    }
+};
+
+struct Mesh_instances : Drawable {
+    /*
+     * Any number of copies of one shared mesh asset, each only a transform
+     * and a color. Instances are culled through a tree of their bounds and
+     * pick their level of detail one by one, but all of them go through a
+     * single triangle batch, so they cost one sorted draw call together.
+     * Handles stay valid until the instance is removed.
+     */
+
+    Mesh_instances(const std::string &filepath) : m_asset(load_mesh_asset(filepath)) { }
+
+    int add(const Mat4 &model, uint32_t color = COLOR_WHITE) {
+        Instance instance = { model, color, 0, true, -1 };
+        int handle;
+        if (!m_free.empty()) {
+            handle = m_free.back();
+            m_free.pop_back();
+            m_instances[handle] = instance;
+        } else {
+            handle = m_instances.size();
+            m_instances.push_back(instance);
+        }
+        m_instances[handle].proxy = m_tree.insert(m_asset->bounds().transformed(model), handle);
+        bounds_changed();
+        return handle;
+    }
+
+    void remove(int handle) {
+        m_instances[handle].alive = false;
+        m_tree.remove(m_instances[handle].proxy);
+        m_free.push_back(handle);
+        bounds_changed();
+    }
+
+    void set_model(int handle, const Mat4 &model) {
+        Instance &instance = m_instances[handle];
+        instance.model = model;
+        if (m_tree.move(instance.proxy, m_asset->bounds().transformed(model))) bounds_changed();
+    }
+
+    void set_color(int handle, uint32_t color) {
+        m_instances[handle].color = color;
+    }
+
+    int count() {
+        return m_instances.size() - m_free.size();
+    }
+
+    void wait_until_loaded() {
+        m_asset->wait();
+    }
+
+    void draw_impl(SDL_Renderer *renderer, Player &player) {
+        loaded();
+        m_visible.clear();
+        {
+            PROFILE_SCOPE("culling");
+            m_tree.query_frustum(player.m_frustum, CLIP_PLANE_COUNT, [&](int handle) { m_visible.push_back(handle); });
+            std::sort(m_visible.begin(), m_visible.end());
+        }
+        if (!m_loaded) {
+            for (int handle: m_visible) {
+                draw_wireframe_box(m_asset->placeholder, m_instances[handle].model, m_instances[handle].color, player);
+            }
+            return;
+        }
+        int triangle_count = m_asset->lods[0].triangle_count;
+        m_batch.clear();
+        Box object_bounds = m_asset->bounds();
+        for (int handle: m_visible) {
+            Instance &instance = m_instances[handle];
+            if (g_occlusion.occludes(object_bounds.transformed(instance.model))) continue;
+            Mat4 model_view = player.m_view * instance.model;
+            instance.lod = m_asset->select_lod(model_view, instance.lod);
+            // ids stay put for the temporal sort as long as the instance keeps its level
+            collect_triangles(m_asset->lods[instance.lod], model_view, instance.color, (int64_t) handle * triangle_count, player, m_batch);
+        }
+        m_batch.draw(renderer);
+    }
+
+    bool raycast(Point3D origin, Vec3 dir, Ray_hit &hit) {
+        if (!loaded()) return false;
+        bool found = false;
+        m_tree.raycast(origin, dir, hit.t, [&](int handle) {
+            found |= m_asset->raycast(m_instances[handle].model, origin, dir, hit);
+            return hit.t;
+        });
+        return found;
+    }
+
+    const char *name() {
+        return "Mesh_instances";
+    }
+
+private:
+    struct Instance {
+        Mat4 model;
+        uint32_t color;
+        int lod;
+        bool alive;
+        int proxy;
+    };
+
+    std::shared_ptr<const Mesh_asset> m_asset;
+    bool m_loaded = false;
+    std::vector<Instance> m_instances;
+    std::vector<int> m_free;
+    Aabb_tree m_tree;
+
+    Triangle_batch m_batch;
+    Frame_array<int> m_visible;
+
+    bool get_bounds(Box &box) {
+        /* around every instance, none while loading or empty */
+        return loaded() && m_tree.bounds(box);
+    }
+
+    bool loaded() {
+        /* once the geometry is there the instances are refit from the placeholder to their real bounds */
+        if (!m_loaded && m_asset->ready()) {
+            m_loaded = true;
+            for (auto &instance: m_instances) {
+                if (!instance.alive) continue;
+                m_tree.remove(instance.proxy);
+                instance.proxy = m_tree.insert(m_asset->bounds().transformed(instance.model), &instance - &m_instances[0]);
+            }
+        }
+        return m_loaded;
+    }
+};
+
+#define VOXEL_SIZE 0.5f
+#define CHUNK_SIZE 16
+
+struct Voxel_world : Drawable {
+    /*
+     * Cubes of size VOXEL_SIZE placed on the VOXEL_SIZE grid, kept in a hash
+     * map of CHUNK_SIZE^3 chunks. Every chunk holds a mesh of the faces that
+     * are not shared with a neighbouring cube, with coplanar faces of the
+     * same color greedily merged into bigger quads. A chunk's mesh is only
+     * rebuilt when a cube in it or right next to it changes.
+     */
+
+    bool add(Point3D pos, uint32_t color) {
+        /* returns false if the cell is already taken */
+        int c[3];
+        cell_of(pos, c);
+        Chunk &chunk = chunk_of(c);
+        uint32_t &cell = chunk.cells[local_index(c)];
+        if (cell) return false;
+        cell = color;
+        ++chunk.count;
+        ++m_count;
+        invalidate_around(c);
+        return true;
+    }
+
+    bool remove(Point3D pos) {
+        /* returns false if there was no cube */
+        int c[3];
+        cell_of(pos, c);
+        auto it = m_chunks.find(chunk_key(c));
+        if (it == m_chunks.end()) return false;
+        uint32_t &cell = it->second.cells[local_index(c)];
+        if (!cell) return false;
+        cell = 0;
+        --m_count;
+        if (--it->second.count == 0) {
+            m_chunks.erase(it);
+        }
+        invalidate_around(c);
+        return true;
+    }
+
+    uint32_t get(const int c[3]) {
+        /* color of the cube at cell c, 0 if empty */
+        auto it = m_chunks.find(chunk_key(c));
+        return it == m_chunks.end() ? 0 : it->second.cells[local_index(c)];
+    }
+
+    size_t count() {
+        return m_count;
+    }
+
+    const char *name() {
+        return "Voxel_world";
+    }
+
+    bool raycast(Point3D origin, Vec3 dir, Ray_hit &hit) {
+        /* steps through the cells along the ray from the one origin is in, the first cube entered is hit */
+        if (!m_count) return false;
+        int c[3];
+        cell_of(origin, c);
+        float o[3] = { origin.x / VOXEL_SIZE, origin.y / VOXEL_SIZE, origin.z / VOXEL_SIZE };
+        float d[3] = { dir.x / VOXEL_SIZE, dir.y / VOXEL_SIZE, dir.z / VOXEL_SIZE };
+        int step[3];
+        float next[3], delta[3]; // distance to the next cell boundary and between boundaries, per axis
+        for (int i = 0; i < 3; ++i) {
+            step[i] = d[i] >= 0 ? 1 : -1;
+            delta[i] = d[i] ? fabsf(1 / d[i]) : INFINITY;
+            next[i] = d[i] ? (c[i] + 0.5f * step[i] - o[i]) / d[i] : INFINITY;
+        }
+        for (;;) {
+            int axis = next[0] <= next[1] && next[0] <= next[2] ? 0 : next[1] <= next[2] ? 1 : 2;
+            float t = next[axis];
+            if (t >= hit.t) return false;
+            c[axis] += step[axis];
+            next[axis] += delta[axis];
+            if (get(c)) {
+                hit.t = t;
+                hit.normal = { axis == 0 ? (float) -step[0] : 0, axis == 1 ? (float) -step[1] : 0, axis == 2 ? (float) -step[2] : 0 };
+                return true;
+            }
+        }
+    }
+
+    void draw_occluders(Player &player) {
+        /* the front faces of the chunks in view; chunks still to be rebuilt are left out */
+        Point3D poly[4 + CLIP_PLANE_COUNT];
+        int codes[4];
+        for (auto &[key, chunk]: m_chunks) {
+            if (chunk.dirty || chunk.quads.empty() || !player.sees(chunk.bounds)) continue;
+            for (const Quad &q: chunk.quads) {
+                for (int j = 0; j < 4; ++j) {
+                    poly[j] = player.m_view.transform_affine(q.corners[j]);
+                    codes[j] = outcode(poly[j], player.m_clip_planes);
+                }
+                if (codes[0] & codes[1] & codes[2] & codes[3]) continue;
+                if (player.m_view.transform_direction(q.normal).dot(poly[0]) >= 0) continue;
+                g_occlusion.add_occluder(poly, 4, codes[0] | codes[1] | codes[2] | codes[3]);
+            }
+        }
+    }
+
+    void draw_impl(SDL_Renderer *renderer, Player &player) {
+        m_batch.clear();
+        int quad_id = -1; // stable while no chunk is rebuilt
+        for (auto &[key, chunk]: m_chunks) {
+            if (chunk.dirty) {
+                PROFILE_SCOPE("voxel meshing");
+                rebuild(chunk);
+            }
+            if (!player.sees(chunk.bounds) || g_occlusion.occludes(chunk.bounds)) {
+                quad_id += chunk.quads.size();
+                continue;
+            }
+            PROFILE_SCOPE("voxel quads");
+
+            for (const Quad &q: chunk.quads) {
+                ++quad_id;
+                Point3D cam[4];
+                int codes[4];
+                for (int j = 0; j < 4; ++j) {
+                    cam[j] = player.m_view.transform_affine(q.corners[j]);
+                    codes[j] = outcode(cam[j], player.m_clip_planes);
+                }
+                if (codes[0] & codes[1] & codes[2] & codes[3]) continue;
+                Vec3 normal = player.m_view.transform_direction(q.normal);
+                if (normal.dot(cam[0]) >= 0) continue;
+
+                // same head-on light as meshes
+                SDL_Color color = shade(q.color, -normal.z);
+                for (int t = 1; t <= 2; ++t) {
+                    Point3D poly[MAX_CLIPPED_VERTICES] = { cam[0], cam[t], cam[t + 1] };
+                    m_batch.add(poly, nullptr, codes[0] | codes[t] | codes[t + 1], color, player.m_clip_planes, quad_id * 2 + t - 1);
+                }
+            }
+        }
+        m_batch.draw(renderer);
+    }
+
+private:
+    struct Quad {
+        Point3D corners[4];
+        Vec3 normal;
+        uint32_t color;
+    };
+
+    struct Chunk {
+        int origin[3]; // cell coordinates of the first cell
+        uint32_t cells[CHUNK_SIZE * CHUNK_SIZE * CHUNK_SIZE] = {};
+        int count = 0;
+        bool dirty = true;
+        std::vector<Quad> quads;
+        Box bounds;
+    };
+
+    std::unordered_map<uint64_t, Chunk> m_chunks;
+    size_t m_count = 0;
+    Triangle_batch m_batch;
+
+    static int floor_div(int a, int n) {
+        return a >= 0 ? a / n : (a - n + 1) / n;
+    }
+
+    static void cell_of(Point3D pos, int c[3]) {
+        c[0] = (int) std::lround(pos.x / VOXEL_SIZE);
+        c[1] = (int) std::lround(pos.y / VOXEL_SIZE);
+        c[2] = (int) std::lround(pos.z / VOXEL_SIZE);
+    }
+
+    static uint64_t chunk_key(const int c[3]) {
+        // 21 bits per chunk coordinate
+        uint64_t key = 0;
+        for (int i = 0; i < 3; ++i) {
+            key = key << 21 | ((uint64_t) (floor_div(c[i], CHUNK_SIZE) + (1 << 20)) & 0x1FFFFF);
+        }
+        return key;
+    }
+
+    static int local_index(const int c[3]) {
+        int x = c[0] - floor_div(c[0], CHUNK_SIZE) * CHUNK_SIZE;
+        int y = c[1] - floor_div(c[1], CHUNK_SIZE) * CHUNK_SIZE;
+        int z = c[2] - floor_div(c[2], CHUNK_SIZE) * CHUNK_SIZE;
+        return (z * CHUNK_SIZE + y) * CHUNK_SIZE + x;
+    }
+
+    Chunk &chunk_of(const int c[3]) {
+        /* creates the chunk if needed */
+        auto [it, inserted] = m_chunks.try_emplace(chunk_key(c));
+        Chunk &chunk = it->second;
+        if (inserted) {
+            for (int i = 0; i < 3; ++i) {
+                chunk.origin[i] = floor_div(c[i], CHUNK_SIZE) * CHUNK_SIZE;
+            }
+            Vec3 lo = { (chunk.origin[0] - 0.5f) * VOXEL_SIZE, (chunk.origin[1] - 0.5f) * VOXEL_SIZE, (chunk.origin[2] - 0.5f) * VOXEL_SIZE };
+            float extent = CHUNK_SIZE * VOXEL_SIZE;
+            chunk.bounds = { lo, lo + Vec3{ extent, extent, extent } };
+        }
+        return chunk;
+    }
+
+    void invalidate_around(const int c[3]) {
+        /* the chunk of c and every neighbouring chunk that touches it */
+        for (int i = -1; i <= 1; ++i) {
+            for (int axis = 0; axis < 3; ++axis) {
+                int n[3] = { c[0], c[1], c[2] };
+                n[axis] += i;
+                auto it = m_chunks.find(chunk_key(n));
+                if (it != m_chunks.end()) it->second.dirty = true;
+            }
+        }
+    }
+
+    void rebuild(Chunk &chunk) {
+        chunk.quads.clear();
+        chunk.dirty = false;
+        uint32_t mask[CHUNK_SIZE * CHUNK_SIZE];
+
+        for (int d = 0; d < 3; ++d) {
+            int u = (d + 1) % 3, v = (d + 2) % 3;
+            for (int side = -1; side <= 1; side += 2) {
+                for (int slice = 0; slice < CHUNK_SIZE; ++slice) {
+                    // faces of this slice that look into an empty cell
+                    for (int b = 0; b < CHUNK_SIZE; ++b) {
+                        for (int a = 0; a < CHUNK_SIZE; ++a) {
+                            int local[3];
+                            local[d] = slice;
+                            local[u] = a;
+                            local[v] = b;
+                            uint32_t color = chunk.cells[(local[2] * CHUNK_SIZE + local[1]) * CHUNK_SIZE + local[0]];
+                            uint32_t neighbour = 0;
+                            if (color) {
+                                local[d] += side;
+                                if (local[d] >= 0 && local[d] < CHUNK_SIZE) {
+                                    neighbour = chunk.cells[(local[2] * CHUNK_SIZE + local[1]) * CHUNK_SIZE + local[0]];
+                                } else {
+                                    int c[3] = { chunk.origin[0] + local[0], chunk.origin[1] + local[1], chunk.origin[2] + local[2] };
+                                    neighbour = get(c);
+                                }
+                            }
+                            mask[b * CHUNK_SIZE + a] = neighbour ? 0 : color;
+                        }
+                    }
+
+                    // greedy merge: grow each face along u, then along v while the whole row matches
+                    for (int b = 0; b < CHUNK_SIZE; ++b) {
+                        for (int a = 0; a < CHUNK_SIZE; ++a) {
+                            uint32_t color = mask[b * CHUNK_SIZE + a];
+                            if (!color) continue;
+                            int w = 1, h = 1;
+                            while (a + w < CHUNK_SIZE && mask[b * CHUNK_SIZE + a + w] == color) ++w;
+                            for (; b + h < CHUNK_SIZE; ++h) {
+                                int k = 0;
+                                while (k < w && mask[(b + h) * CHUNK_SIZE + a + k] == color) ++k;
+                                if (k < w) break;
+                            }
+                            for (int y = b; y < b + h; ++y) {
+                                std::fill(mask + y * CHUNK_SIZE + a, mask + y * CHUNK_SIZE + a + w, 0);
+                            }
+                            chunk.quads.push_back(make_quad(chunk, d, side, slice, a, b, w, h, color));
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    static Quad make_quad(const Chunk &chunk, int d, int side, int slice, int a, int b, int w, int h, uint32_t color) {
+        int u = (d + 1) % 3, v = (d + 2) % 3;
+        float plane = chunk.origin[d] + slice + 0.5f * side;
+        float u0 = chunk.origin[u] + a - 0.5f, u1 = u0 + w;
+        float v0 = chunk.origin[v] + b - 0.5f, v1 = v0 + h;
+        float uv[4][2] = { { u0, v0 }, { u1, v0 }, { u1, v1 }, { u0, v1 } };
+
+        Quad q;
+        for (int j = 0; j < 4; ++j) {
+            float p[3];
+            p[d] = plane;
+            p[u] = uv[j][0];
+            p[v] = uv[j][1];
+            q.corners[j] = Point3D{ p[0], p[1], p[2] } * VOXEL_SIZE;
+        }
+        float n[3] = { 0, 0, 0 };
+        n[d] = side;
+        q.normal = { n[0], n[1], n[2] };
+        q.color = color;
+        return q;
+    }
+};
+
+struct Axes : Drawable {
+
+    Axes(float length) : m_length(length) { }
+
+    void draw_impl(SDL_Renderer *renderer, Player &player) {
+        
+        // the HUD goes on top of everything rasterized so far
+        g_rasterizer.flush(renderer);
+        g_line_batch.flush(renderer);
+
+        // draw in front of the player
+        Point3D pos = player.in_front();
+
+        Point2D offset = { 0.35f * render_width, -0.35f * render_height };
+        Point2D origin = { 0.5f * render_width,  0.5f * render_height };
+        origin += offset;
+
+        Point2D x = get_onscreen_point(pos + (Point3D) {m_length, 0, 0}, player) + offset;
+        Point2D y = get_onscreen_point(pos + (Point3D) {0, m_length, 0}, player) + offset;
+        Point2D z = get_onscreen_point(pos + (Point3D) {0, 0, m_length}, player) + offset;
+
+
+        SDL_SetRenderDrawColor(g_renderer, 0x31, 0x31, 0x31, 0xFF);
+#define RECT_SIZE (render_height + render_width) / 12
+        SDL_Rect axis_rect = { (int) (0.85f * render_width) - RECT_SIZE / 2, (int) (0.15f * render_height) - RECT_SIZE / 2, RECT_SIZE, RECT_SIZE};
+        SDL_RenderFillRect(g_renderer, &axis_rect);
+
+        // draw x axis
+        g_line_batch.add(origin, x, COLOR_GREEN);
+        g_line_batch.add({ x.x - 10, x.y - 20 }, { x.x + 10, x.y      }, COLOR_GREEN);
+        g_line_batch.add({ x.x - 10, x.y      }, { x.x + 10, x.y - 20 }, COLOR_GREEN);
+
+        // draw y axis
+        g_line_batch.add(origin, y, COLOR_GREEN);
+        g_line_batch.add({ y.x + 15, y.y      }, { y.x + 15, y.y - 10 }, COLOR_GREEN);
+        g_line_batch.add({ y.x + 15, y.y - 10 }, { y.x + 5,  y.y - 20 }, COLOR_GREEN);
+        g_line_batch.add({ y.x + 15, y.y - 10 }, { y.x + 25, y.y - 20 }, COLOR_GREEN);
+
+        //draw z axis
+        g_line_batch.add(origin, z, COLOR_GREEN);
+        g_line_batch.add({ z.x - 10, z.y - 25 }, { z.x + 10, z.y - 25 }, COLOR_GREEN);
+        g_line_batch.add({ z.x + 10, z.y - 25 }, { z.x - 10, z.y - 5  }, COLOR_GREEN);
+        g_line_batch.add({ z.x - 10, z.y - 5  }, { z.x + 10, z.y - 5  }, COLOR_GREEN);
+        g_line_batch.flush(renderer);
+
+    }
+
+    const char *name() {
+        return "Axes";
+    }
+
+private:
+    float m_length;
+};
+
+struct Space_ship {
+    /*
+     * A position and a heading; the geometry is an instance in a
+     * Mesh_instances shared by the whole fleet, which draws it.
+     */
+
+    Space_ship(Mesh_instances &fleet, Point3D pos, uint32_t color = COLOR_WHITE) : m_fleet(fleet), m_pos(pos), m_angle(0) {
+        m_instance = m_fleet.add(model(), color);
+    }
+
+    ~Space_ship() {
+        m_fleet.remove(m_instance);
+    }
+
+    Space_ship(const Space_ship &) = delete;
+    Space_ship &operator=(const Space_ship &) = delete;
+
+    void move_forward(float d) {
+        m_pos.z += std::cos(m_angle) * d;
+        m_pos.x += std::sin(m_angle) * d;
+        m_fleet.set_model(m_instance, model());
+    }
+
+    void rotate(float angle) {
+        m_angle += angle;
+        m_fleet.set_model(m_instance, model());
+    }
+
+    Mat4 model() {
+        return Mat4::translation(m_pos) * Mat4::rotation_y(m_angle);
+    }
+
+private:
+    Mesh_instances &m_fleet;
+    int m_instance;
+    Point3D m_pos;
+    float m_angle;
+};
+
+/******************** Scene *************************************************/
+
+// how far from the player the crosshair picks surfaces
+#define PICK_DISTANCE 20.0f
+
+class Scene {
+    /*
+     * The drawables of a frame. Those with bounds are leaves of an
+     * Aabb_tree, so culling and picking only visit the subtrees that reach
+     * into the view or along the ray; the rest are always drawn and always
+     * tested. Drawables report moves through bounds_changed() and leave
+     * the scene when they are destroyed.
+     */
+public:
+    Scene() = default;
+    Scene(const Scene &) = delete;
+    Scene &operator=(const Scene &) = delete;
+
+    ~Scene() {
+        for (Drawable *drawable: m_drawables) {
+            if (drawable) drawable->m_scene = nullptr;
+        }
+    }
+
+    void add(Drawable *drawable) {
+        if (drawable->m_scene) drawable->m_scene->remove(drawable);
+        int slot;
+        if (!m_free.empty()) {
+            slot = m_free.back();
+            m_free.pop_back();
+            m_drawables[slot] = drawable;
+        } else {
+            slot = m_drawables.size();
+            m_drawables.push_back(drawable);
+        }
+        drawable->m_scene = this;
+        drawable->m_scene_slot = slot;
+        drawable->m_scene_proxy = -1;
+        m_unbounded.push_back(slot);
+        update(drawable);
+    }
+
+    void remove(Drawable *drawable) {
+        int slot = drawable->m_scene_slot;
+        if (drawable->m_scene_proxy >= 0) {
+            m_tree.remove(drawable->m_scene_proxy);
+        } else {
+            m_unbounded.erase(std::find(m_unbounded.begin(), m_unbounded.end(), slot));
+        }
+        m_drawables[slot] = nullptr;
+        m_free.push_back(slot);
+        drawable->m_scene = nullptr;
+    }
+
+    void update(Drawable *drawable) {
+        /* moves drawable to its new bounds, or between the tree and the always drawn ones */
+        Box box;
+        bool bounded = drawable->get_bounds(box);
+        int &proxy = drawable->m_scene_proxy;
+        if (bounded && proxy >= 0) {
+            m_tree.move(proxy, box);
+        } else if (bounded) {
+            m_unbounded.erase(std::find(m_unbounded.begin(), m_unbounded.end(), drawable->m_scene_slot));
+            proxy = m_tree.insert(box, drawable->m_scene_slot);
+        } else if (proxy >= 0) {
+            m_tree.remove(proxy);
+            proxy = -1;
+            m_unbounded.push_back(drawable->m_scene_slot);
+        }
+    }
+
+    void draw(SDL_Renderer *renderer, Player &player) {
+        /*
+         * the drawables without bounds in the order they were added, then
+         * the ones in view that are not occluded, also in that order
+         */
+        for (size_t i = 0; i < m_unbounded.size();) {
+            // those that got bounds since, like a mesh whose geometry arrived
+            Drawable *drawable = m_drawables[m_unbounded[i]];
+            Box box;
+            if (drawable->get_bounds(box)) update(drawable);
+            else ++i;
+        }
+        m_visible.clear();
+        for (int slot: m_unbounded) m_visible.push_back(slot);
+        size_t first = m_visible.size();
+        {
+            PROFILE_SCOPE("culling");
+            m_tree.query_frustum(player.m_frustum, CLIP_PLANE_COUNT, [&](int slot) { m_visible.push_back(slot); });
+            std::sort(m_visible.begin() + first, m_visible.end());
+        }
+        g_occlusion.begin_frame(player);
+        if (g_occlusion_culling) {
+            PROFILE_SCOPE("occluders");
+            for (int slot: m_visible) {
+                if (m_drawables[slot]->active) m_drawables[slot]->draw_occluders(player);
+            }
+            g_occlusion.build_pyramid();
+        }
+        for (int slot: m_visible) {
+            m_drawables[slot]->draw(renderer, player);
+        }
+    }
+
+    bool raycast(Point3D origin, Vec3 dir, float max_distance, Ray_hit &hit) {
+        /* the closest surface of an active drawable along dir within max_distance, false if there is none */
+        PROFILE_SCOPE("picking");
+        dir = dir * (1 / sqrtf(dir.dot(dir)));
+        hit = { max_distance, origin, { 0, 0, 0 }, nullptr };
+        auto test = [&](int slot) {
+            Drawable *drawable = m_drawables[slot];
+            if (drawable->active && drawable->raycast(origin, dir, hit)) hit.drawable = drawable;
+            return hit.t;
+        };
+        for (int slot: m_unbounded) test(slot);
+        m_tree.raycast(origin, dir, hit.t, test);
+        hit.point = origin + dir * hit.t;
+        return hit.drawable;
+    }
+
+    int size() {
+        return m_drawables.size() - m_free.size();
+    }
+
+private:
+    std::vector<Drawable *> m_drawables; // by slot, nullptr for free slots
+    std::vector<int> m_free;
+    std::vector<int> m_unbounded;        // slots of the drawables without bounds
+    Aabb_tree m_tree;                    // of slots
+    Frame_array<int> m_visible;
+};
+
+Drawable::~Drawable() {
+    if (m_scene) m_scene->remove(this);
+}
+
+void Drawable::bounds_changed() {
+    if (m_scene) m_scene->update(this);
+}
+
+/******************** Dynamic resolution ************************************/
+
+// the render size never goes below this share of the window's width and height
+#define RESOLUTION_MIN_SCALE 0.5f
+// the scale aims at frames this much of the budget long, the rest absorbs spikes
+#define RESOLUTION_TARGET 0.85f
+
+struct Resolution_scaler {
+    /*
+     * Renders the scene into a texture a fraction of the window's size and
+     * stretches it over the window, with the fraction picked every frame
+     * to keep frame times within budget_ms. The time to render is taken to
+     * grow with the number of pixels, so the scale moves by the square
+     * root of how far the smoothed frame time is off target: down at once
+     * when a frame runs long, back up a little every frame. Only the work
+     * until present is timed, waiting for vsync is not. A budget of 0
+     * renders at full size.
+     */
+    float budget_ms = 0;
+    float scale = 1;
+    float headroom = 0; // share of the budget the smoothed frame time leaves over
+
+    void reset() {
+        scale = 1;
+        headroom = 0;
+        m_frame_ms = 0;
+    }
+
+    void begin_frame(SDL_Renderer *renderer) {
+        /* sets render_width and render_height and points the renderer at what to render into */
+        render_width = screen_width;
+        render_height = screen_height;
+        m_scaled = budget_ms > 0 && scale < 1;
+        if (!m_scaled) return;
+        render_width = std::max((int) (screen_width * scale), 1);
+        render_height = std::max((int) (screen_height * scale), 1);
+        // as big as the window, a smaller scale only uses its top left corner
+        if (screen_width > m_target_width || screen_height > m_target_height) {
+            if (m_target) SDL_DestroyTexture(m_target);
+            m_target_width = std::max(screen_width, m_target_width);
+            m_target_height = std::max(screen_height, m_target_height);
+            scp((m_target = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, m_target_width, m_target_height)),
+                    "Could not create render target");
+        }
+        scc(SDL_SetRenderTarget(renderer, m_target), "Could not set render target");
+        SDL_Rect viewport = { 0, 0, render_width, render_height };
+        SDL_RenderSetViewport(renderer, &viewport);
+    }
+
+    void end_frame(SDL_Renderer *renderer) {
+        /* stretches what was rendered over the window, everything after this is drawn at full size */
+        if (m_scaled) {
+            SDL_SetRenderTarget(renderer, nullptr);
+            SDL_Rect source = { 0, 0, render_width, render_height };
+            SDL_RenderCopy(renderer, m_target, &source, nullptr);
+        }
+        render_width = screen_width;
+        render_height = screen_height;
+    }
+
+    void update(double frame_ms) {
+        /* picks the scale of the next frame from how long this one took */
+        if (budget_ms <= 0) {
+            reset();
+            return;
+        }
+        // longer frames count in right away, shorter ones slowly
+        m_frame_ms = m_frame_ms > 0 ? m_frame_ms + (frame_ms - m_frame_ms) * (frame_ms > m_frame_ms ? 0.5 : 0.1) : frame_ms;
+        headroom = 1 - m_frame_ms / budget_ms;
+        float wanted = scale * sqrt(budget_ms * RESOLUTION_TARGET / std::max(m_frame_ms, 0.01));
+        // leave it be when close, so the picture does not shimmer
+        if (wanted < scale * 0.97f || wanted > scale * 1.03f) {
+            scale = std::clamp(std::min(wanted, scale * 1.02f), RESOLUTION_MIN_SCALE, 1.0f);
+        }
+    }
+
+private:
+    SDL_Texture *m_target = nullptr;
+    int m_target_width = 0;
+    int m_target_height = 0;
+    bool m_scaled = false;
+    double m_frame_ms = 0;
+};
+
+Resolution_scaler g_resolution;
+
+void draw_frame(Scene &scene, Player &player) {
+    g_frame_stats = {};
+    g_frame_arena.reset();
+    long heap_allocations = g_heap_allocations;
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    {
+        PROFILE_SCOPE("clear");
+        g_resolution.begin_frame(g_renderer);
+        SDL_SetRenderDrawColor(g_renderer, 0x00, 0x00, 0x00, 0xFF);
+        SDL_RenderClear(g_renderer);
+        if (g_backend == BACKEND_SOFTWARE) {
+            g_rasterizer.begin_frame(g_renderer, render_width, render_height);
+        }
+    }
+
+    /***************** Drawing *******************************/
+
+    player.update_view();
+
+    scene.draw(g_renderer, player);
+
+    {
+        PROFILE_SCOPE("flush");
+        g_rasterizer.flush(g_renderer);
+        g_line_batch.flush(g_renderer);
+    }
+    {
+        PROFILE_SCOPE("upscale");
+        g_resolution.end_frame(g_renderer);
+    }
+
+    //cross
+    SDL_SetRenderDrawColor(g_renderer, UNHEX(COLOR_BEIGE));
+    SDL_RenderDrawLine(g_renderer, screen_width / 2, screen_height / 2 - 10, screen_width / 2, screen_height / 2 + 10);
+    SDL_RenderDrawLine(g_renderer, screen_width / 2 - 10, screen_height / 2, screen_width / 2 + 10, screen_height / 2);
+
+#ifdef PROFILE
+    if (g_profiler.overlay) {
+        g_profiler.draw_overlay(g_renderer);
+    }
+#endif
+
+    /*********************************************************/
+
+    g_frame_stats.render_scale = g_resolution.budget_ms > 0 ? g_resolution.scale : 1;
+    g_resolution.update((double) (SDL_GetPerformanceCounter() - start) * 1000 / SDL_GetPerformanceFrequency());
+    g_frame_stats.budget_headroom = g_resolution.headroom;
+
+    {
+        PROFILE_SCOPE("present");
         SDL_RenderPresent(g_renderer);
     }
+    g_frame_stats.heap_allocations = g_heap_allocations - heap_allocations;
+#ifdef PROFILE
+    g_profiler.end_frame();
+#endif
+}
+
+/******************** Simulation ********************************************/
+
+#define SIM_TICK_RATE 60
+const std::chrono::nanoseconds SIM_TICK(1000000000 / SIM_TICK_RATE);
+// world units per second
+#define PLAYER_SPEED 3.0f
+
+enum Sim_key {
+    KEY_FORWARD  = 1 << 0,
+    KEY_BACKWARD = 1 << 1,
+    KEY_LEFT     = 1 << 2,
+    KEY_RIGHT    = 1 << 3,
+    KEY_DOWN     = 1 << 4,
+    KEY_UP       = 1 << 5,
+};
+
+struct Sim_input {
+    /* written by the render thread from SDL's input, consumed by the simulation thread */
+    std::atomic<uint32_t> keys{0};      // Sim_key bits currently held
+    std::atomic<int> mouse_dx{0};       // relative mouse motion since the last tick
+    std::atomic<int> mouse_dy{0};
+};
+
+struct Sim_state {
+    Point3D pos;
+    float vertical_view_angle;
+    float horizontal_view_angle;
+    float ship_angle;
+    float ship_spin;
+};
+
+struct Sim_snapshot {
+    /* the last two ticks, so the render thread can interpolate between them */
+    Sim_state previous;
+    Sim_state current;
+    std::chrono::steady_clock::time_point time; // start of the tick that made current, when previous is shown
+};
+
+template <typename T>
+class Triple_buffer {
+    /*
+     * Lock-free hand-over of the latest value from one writer thread to one
+     * reader thread. The writer fills back() and publish()es it by swapping
+     * it with the middle slot; the reader swaps the middle slot into the
+     * front when it holds something new. Neither side ever waits.
+     */
+public:
+    Triple_buffer(const T &initial) {
+        for (auto &slot: m_slots) slot = initial;
+    }
+
+    T &back() {
+        return m_slots[m_back];
+    }
+
+    void publish() {
+        m_back = m_middle.exchange(m_back | FRESH, std::memory_order_acq_rel) & ~FRESH;
+    }
+
+    const T &latest() {
+        if (m_middle.load(std::memory_order_relaxed) & FRESH) {
+            m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) & ~FRESH;
+        }
+        return m_slots[m_front];
+    }
+
+private:
+    static const int FRESH = 4;
+
+    T m_slots[3];
+    int m_back = 0;
+    std::atomic<int> m_middle{1};
+    int m_front = 2;
+};
+
+class Simulation {
+    /*
+     * Player movement and scene animation at a fixed SIM_TICK_RATE on
+     * their own thread, independent of how long frames take to render.
+     * Every tick publishes a snapshot; the render thread draws the state
+     * interpolated between the last two ticks, one tick behind.
+     */
+public:
+    Sim_input input;
+
+    Simulation(const Player &player)
+            : m_player(player),
+              m_snapshots({ state(0, 0), state(0, 0), std::chrono::steady_clock::now() }) {
+        m_thread = std::thread([this] { run(); });
+    }
+
+    ~Simulation() {
+        m_running = false;
+        m_thread.join();
+    }
+
+    Sim_state interpolated() {
+        /* render thread only */
+        const Sim_snapshot &s = m_snapshots.latest();
+        float t = std::chrono::duration<float>(std::chrono::steady_clock::now() - s.time) / SIM_TICK;
+        t = std::clamp(t, 0.0f, 1.0f);
+        auto lerp = [t](float a, float b) { return a + (b - a) * t; };
+        return { s.previous.pos + (s.current.pos - s.previous.pos) * t,
+                 lerp(s.previous.vertical_view_angle, s.current.vertical_view_angle),
+                 lerp(s.previous.horizontal_view_angle, s.current.horizontal_view_angle),
+                 lerp(s.previous.ship_angle, s.current.ship_angle),
+                 lerp(s.previous.ship_spin, s.current.ship_spin) };
+    }
+
+private:
+    // only touched by the simulation thread once it runs
+    Player m_player;
+    float m_ship_angle = 0;
+    float m_ship_spin = 0;
+
+    Triple_buffer<Sim_snapshot> m_snapshots;
+    std::atomic<bool> m_running{true};
+    std::thread m_thread;
+
+    Sim_state state(float ship_angle, float ship_spin) {
+        return { m_player.m_pos, m_player.m_vertical_view_angle, m_player.m_horizontal_view_angle, ship_angle, ship_spin };
+    }
+
+    void run() {
+        auto next = std::chrono::steady_clock::now();
+        Sim_state current = state(m_ship_angle, m_ship_spin);
+        while (m_running) {
+            Sim_state previous = current;
+            tick();
+            current = state(m_ship_angle, m_ship_spin);
+
+            m_snapshots.back() = { previous, current, next };
+            m_snapshots.publish();
+            next += SIM_TICK;
+
+            auto now = std::chrono::steady_clock::now();
+            if (now - next > SIM_TICK * 5) {
+                next = now; // too far behind (suspended or debugged), skip the lost ticks instead of racing through them
+            }
+            std::this_thread::sleep_until(next);
+        }
+    }
+
+    void tick() {
+        float step = PLAYER_SPEED / SIM_TICK_RATE;
+        uint32_t keys = input.keys.load(std::memory_order_relaxed);
+        int dx = input.mouse_dx.exchange(0, std::memory_order_relaxed);
+        int dy = input.mouse_dy.exchange(0, std::memory_order_relaxed);
+
+        m_player.m_vertical_view_angle = std::clamp(m_player.m_vertical_view_angle + (double) dy / 400, -M_PI / 2, M_PI / 2); // can only look 90 degrees up
+        m_player.m_horizontal_view_angle = m_player.m_horizontal_view_angle + (double) dx / 400;
+        if (keys & KEY_RIGHT) {
+            m_player.move_right(step);
+        }
+        if (keys & KEY_LEFT) {
+            m_player.move_left(step);
+        }
+        if (keys & KEY_FORWARD) {
+            m_player.move_forward(step);
+        }
+        if (keys & KEY_BACKWARD) {
+            m_player.move_backward(step);
+        }
+        if (keys & KEY_DOWN) {
+            m_player.move_y(step);
+        }
+        if (keys & KEY_UP) {
+            m_player.move_y(-step);
+        }
+
+        m_ship_spin += m_ship_angle += 0.000001;
+    }
+};
+
+/******************** Benchmark *********************************************/
+
+Mesh *generate_terrain(int size) {
+    /* size x size quads of rolling hills, 2 * size^2 triangles */
+    std::vector<Point3D> vertices;
+    std::vector<int> indices;
+    vertices.reserve((size + 1) * (size + 1));
+    indices.reserve(size * size * 6);
+    float step = 20.0f / size;
+    for (int z = 0; z <= size; ++z) {
+        for (int x = 0; x <= size; ++x) {
+            float px = x * step - 10, pz = z * step - 10;
+            vertices.push_back({ px, sinf(px * 0.7f) * cosf(pz * 0.5f) * 1.5f, pz });
+        }
+    }
+    for (int z = 0; z < size; ++z) {
+        for (int x = 0; x < size; ++x) {
+            int i = z * (size + 1) + x;
+            int quad[6] = { i, i + 1, i + size + 1, i + 1, i + size + 2, i + size + 1 };
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+    return new Mesh(std::move(vertices), std::move(indices));
+}
+
+void add_shell(Voxel_world &world, const Box &box, uint32_t color) {
+    /* the surface of box as a closed layer of cubes */
+    int min[3] = { (int) floorf(box.min.x / VOXEL_SIZE), (int) floorf(box.min.y / VOXEL_SIZE), (int) floorf(box.min.z / VOXEL_SIZE) };
+    int max[3] = { (int) ceilf(box.max.x / VOXEL_SIZE), (int) ceilf(box.max.y / VOXEL_SIZE), (int) ceilf(box.max.z / VOXEL_SIZE) };
+    for (int x = min[0]; x <= max[0]; ++x) {
+        for (int y = min[1]; y <= max[1]; ++y) {
+            for (int z = min[2]; z <= max[2]; ++z) {
+                if (x == min[0] || x == max[0] || y == min[1] || y == max[1] || z == min[2] || z == max[2]) {
+                    world.add(Point3D{ (float) x, (float) y, (float) z } * VOXEL_SIZE, color);
+                }
+            }
+        }
+    }
+}
+
+struct Bench_scene {
+    const char *name;
+    std::vector<Drawable *> drawables;
+    Box bounds;
+};
+
+void run_benchmarks(int frames) {
+    /*
+     * Renders every scene with both backends along an orbit around it and
+     * prints one JSON object per run to stdout.
+     */
+    Mesh ship("ship.obj");
+    Mesh cube("cube.obj");
+    // loads run in the background, the scenes are timed with the real geometry
+    ship.wait_until_loaded();
+    cube.wait_until_loaded();
+    std::unique_ptr<Mesh> terrain(generate_terrain(400));
+
+    Voxel_world cube_field;
+    const int field = 22; // cubes on every other cell, so no faces are shared
+    for (int x = 0; x < field; ++x) {
+        for (int y = 0; y < field; ++y) {
+            for (int z = 0; z < field; ++z) {
+                cube_field.add(Point3D{ x - field / 2.0f, y - field / 2.0f, z - field / 2.0f } * (2 * VOXEL_SIZE), (x + y + z) % 2 ? COLOR_RED : COLOR_GREEN);
+            }
+        }
+    }
+    float half = field * VOXEL_SIZE;
+
+    Cube_set wireframes;
+    std::deque<Cube> wireframe_cubes;
+    const int grid = 16;
+    for (int x = 0; x < grid; ++x) {
+        for (int y = 0; y < grid; ++y) {
+            for (int z = 0; z < grid; ++z) {
+                wireframe_cubes.emplace_back(wireframes, Point3D{ x - grid / 2.0f, y - grid / 2.0f, z - grid / 2.0f } * 2, 1.0f, (x + y + z) % 2 ? COLOR_RED : COLOR_GREEN);
+            }
+        }
+    }
+
+    // 500 ships sharing ship.obj's geometry with the "ship" scene
+    Mesh_instances fleet("ship.obj");
+    std::deque<Space_ship> ships;
+    Box ship_box = ship.bounds();
+    Vec3 ship_size = ship_box.max - ship_box.min;
+    float spacing = std::max({ ship_size.x, ship_size.z, 0.1f }) * 1.5f;
+    for (int i = 0; i < 500; ++i) {
+        ships.emplace_back(fleet, Point3D{ (i % 25 - 12) * spacing, (i / 25 % 2) * ship_size.y * 2, (i / 25 - 10) * spacing },
+                           (i % 3 == 0 ? COLOR_RED : i % 3 == 1 ? COLOR_GREEN : COLOR_BEIGE));
+    }
+    float fleet_half = 13 * spacing;
+    fleet.wait_until_loaded();
+
+    // the same fleet inside a closed box of cubes, half as tall as it is wide so its walls
+    // are never only seen edge on: nearly all hidden whenever the orbit is outside of it
+    Voxel_world walls;
+    float wall_height = fleet_half / 2;
+    Box walled = { { -fleet_half - spacing, ship_size.y - wall_height, -fleet_half - spacing }, { fleet_half + spacing, ship_size.y + wall_height, fleet_half + spacing } };
+    add_shell(walls, walled, COLOR_BEIGE);
+
+    Bench_scene scenes[] = {
+        { "ship",       { &ship },       ship.bounds() },
+        { "cube",       { &cube },       cube.bounds() },
+        { "cube_field", { &cube_field }, { { -half, -half, -half }, { half, half, half } } },
+        { "terrain",    { terrain.get() }, terrain->bounds() },
+        { "fleet",      { &fleet },      { { -fleet_half, -ship_size.y, -fleet_half }, { fleet_half, ship_size.y * 3, fleet_half } } },
+        { "wireframes", { &wireframes }, { { -grid - 0.5f, -grid - 0.5f, -grid - 0.5f }, { grid - 1.5f, grid - 1.5f, grid - 1.5f } } },
+        { "walled_fleet", { &walls, &fleet }, walled },
+    };
+
+    std::vector<double> times(frames);
+    for (auto &scene: scenes) {
+        Scene drawn;
+        for (Drawable *drawable: scene.drawables) drawn.add(drawable);
+        Point3D center = (scene.bounds.min + scene.bounds.max) * 0.5f;
+        Vec3 diagonal = scene.bounds.max - scene.bounds.min;
+        float radius = std::max(sqrtf(diagonal.dot(diagonal)), 1.0f);
+
+        // the software backend once on one thread and once on all of them
+        struct { Render_backend backend; int raster_threads; } runs[] = { { BACKEND_SDL, 0 }, { BACKEND_SOFTWARE, 1 }, { BACKEND_SOFTWARE, 0 } };
+        for (auto run: runs) {
+            Render_backend backend = run.backend;
+            g_backend = backend;
+            g_raster_threads = run.raster_threads;
+            long triangles = 0;
+            long heap_allocations = 0;
+            long draw_calls = 0;
+            double render_scale = 0;
+            long occluded = 0, unoccluded = 0;
+            g_resolution.reset();
+            for (int i = 0; i < frames; ++i) {
+                // one full orbit, bobbing up and down and moving in and out
+                float t = 2 * M_PI * i / frames;
+                Player player(0, 0, 0);
+                player.m_pos = center + Vec3{ sinf(t) * radius, sinf(2 * t) * radius * 0.3f, cosf(t) * radius } * (0.6f + 0.4f * cosf(3 * t));
+                player.look_at(center);
+
+                Uint64 start = SDL_GetPerformanceCounter();
+                draw_frame(drawn, player);
+                times[i] = (double) (SDL_GetPerformanceCounter() - start) * 1000 / SDL_GetPerformanceFrequency();
+                triangles += g_frame_stats.triangles;
+                heap_allocations += g_frame_stats.heap_allocations;
+                draw_calls += g_frame_stats.draw_calls;
+                render_scale += g_frame_stats.render_scale;
+                occluded += g_frame_stats.occluded;
+                unoccluded += g_frame_stats.unoccluded;
+            }
+
+            double total = 0;
+            for (double t: times) total += t;
+            std::vector<double> sorted = times;
+            std::sort(sorted.begin(), sorted.end());
+            printf("{\"scene\": \"%s\", \"backend\": \"%s\", \"width\": %d, \"height\": %d, \"frames\": %d, "
+                   "\"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"triangles_per_frame\": %.0f, \"triangles_per_sec\": %.0f, \"draw_calls_per_frame\": %.1f, \"heap_allocs_per_frame\": %.2f, \"kernels\": \"%s\", \"raster_threads\": %d, \"budget_ms\": %.2f, \"render_scale\": %.3f, \"occluded_per_frame\": %.1f, \"unoccluded_per_frame\": %.1f}\n",
+                   scene.name, backend_name(backend), screen_width, screen_height, frames,
+                   total / frames, sorted[frames / 2], sorted[std::min(frames - 1, frames * 99 / 100)],
+                   (double) triangles / frames, total > 0 ? triangles / (total / 1000) : 0.0, (double) draw_calls / frames, (double) heap_allocations / frames, simd_level_name(g_simd_level),
+                   backend == BACKEND_SDL ? 1 : g_raster_threads ? g_raster_threads : worker_pool().size() + 1,
+                   g_resolution.budget_ms, render_scale / frames, (double) occluded / frames, (double) unoccluded / frames);
+            fflush(stdout);
+        }
+    }
+}
+
+/******************** Tests *************************************************/
+
+bool test_simulation_interpolates() {
+    /*
+     * frames drawn between two ticks have to show the states between them,
+     * so sampling much faster than SIM_TICK_RATE sees far more distinct
+     * positions than ticks went by, and never one going backwards
+     */
+    Player player(0, 0, 0);
+    Simulation simulation(player);
+    simulation.input.keys = KEY_FORWARD;
+    auto start = std::chrono::steady_clock::now();
+    float last = -1;
+    int distinct = 0;
+    bool backwards = false;
+    while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(100)) {
+        Vec3 travelled = simulation.interpolated().pos - player.m_pos;
+        float distance = sqrtf(travelled.dot(travelled));
+        backwards |= distance < last;
+        distinct += distance != last;
+        last = distance;
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+    int ticks = (std::chrono::steady_clock::now() - start) / SIM_TICK + 1;
+    return !backwards && distinct > 2 * ticks;
+}
+
+bool test_mesh_asset_freed() {
+    /* an asset goes away with the last mesh using it, and a new one is loaded afterwards */
+    std::weak_ptr<const Mesh_asset> weak;
+    {
+        Mesh mesh("cube.obj");
+        mesh.wait_until_loaded();
+        weak = load_mesh_asset("cube.obj");
+    }
+    return weak.expired() && load_mesh_asset("cube.obj") != nullptr;
+}
+
+bool test_cube_set_picks() {
+    /* picking finds the nearest cube left after removals and moves shuffled the arrays */
+    Cube_set set;
+    std::deque<Cube> cubes;
+    for (int i = 0; i < 100; ++i) cubes.emplace_back(set, Point3D{ 0, 0, -2.0f * i - 2 }, 1.0f);
+    Scene scene;
+    scene.add(&set);
+    for (int i = 0; i < 10; ++i) cubes.pop_front();
+    Ray_hit hit;
+    bool ok = scene.raycast({ 0, 0, 0 }, { 0, 0, -1 }, 1000, hit) && hit.drawable == &set && fabsf(hit.t - 21.5f) < 1e-4f;
+    cubes.front().move(5);
+    ok &= scene.raycast({ 0, 0, 0 }, { 0, 0, -1 }, 1000, hit) && fabsf(hit.t - 23.5f) < 1e-4f;
+    while (cubes.size() > 1) cubes.pop_back();
+    ok &= !scene.raycast({ 0, 0, 0 }, { 0, 0, -1 }, 1000, hit) && set.count() == 1;
+    return ok;
+}
+
+bool test_walled_fleet_occluded() {
+    /*
+     * ships inside a closed shell of cubes, looked at from all around it
+     * with the software backend: at least 90% of the ships in view have
+     * to be occluded in every frame once the chunks are built
+     */
+    Mesh_instances fleet("ship.obj");
+    std::deque<Space_ship> ships;
+    for (int i = 0; i < 100; ++i) {
+        ships.emplace_back(fleet, Point3D{ (i % 10 - 4.5f) * 12, 0, (i / 10 - 4.5f) * 12 });
+    }
+    fleet.wait_until_loaded();
+    Box ship_box = load_mesh_asset("ship.obj")->bounds(), inside = ship_box.transformed(ships[0].model());
+    for (auto &ship: ships) inside = inside.merged(ship_box.transformed(ship.model()));
+
+    Voxel_world walls;
+    // half a ship spacing around the fleet, and as tall as it is wide
+    Vec3 margin = { 6, (inside.max.x - inside.min.x) / 2, 6 };
+    add_shell(walls, { inside.min - margin, inside.max + margin }, COLOR_BEIGE);
+    Scene scene;
+    scene.add(&walls);
+    scene.add(&fleet);
+
+    Render_backend backend = g_backend;
+    g_backend = BACKEND_SOFTWARE;
+    Point3D center = (inside.min + inside.max) * 0.5f;
+    Vec3 diagonal = inside.max - inside.min;
+    float radius = sqrtf(diagonal.dot(diagonal));
+    bool ok = true;
+    for (int i = -1; i < 12; ++i) {
+        float t = 2 * M_PI * i / 12;
+        Player player(0, 0, 0);
+        player.m_pos = center + Vec3{ sinf(t) * radius, (i % 3 - 1) * radius * 0.4f, cosf(t) * radius };
+        player.look_at(center);
+        draw_frame(scene, player);
+        if (i < 0) continue; // the first frame builds the chunks
+        int in_view = 0, occluded = 0;
+        for (auto &ship: ships) {
+            Box box = ship_box.transformed(ship.model());
+            if (!player.sees(box)) continue;
+            ++in_view;
+            occluded += g_occlusion.occludes(box);
+        }
+        ok &= occluded >= in_view * 0.9f;
+    }
+    g_backend = backend;
+    return ok;
+}
+
+int run_tests() {
+    /* prints a line per test, returns how many failed */
+    struct { const char *name; bool (*run)(); } tests[] = {
+        { "simulation_interpolates", test_simulation_interpolates },
+        { "mesh_asset_freed",        test_mesh_asset_freed },
+        { "cube_set_picks",          test_cube_set_picks },
+        { "walled_fleet_occluded",   test_walled_fleet_occluded },
+    };
+    int failed = 0;
+    for (auto &test: tests) {
+        bool ok = test.run();
+        printf("%s %s\n", ok ? "ok    " : "FAILED", test.name);
+        failed += !ok;
+    }
+    return failed;
+}
+
+/****************************************************************************/
+
+int main(int argc, char **argv) {
+    /*
+     * ./main                   interactive
+     * ./main --headless        interactive loop without a display
+     * ./main --bench [frames]  headless benchmark suite, JSON lines on stdout
+     * ./main --test            headless self tests, fails if any of them does
+     * --budget <ms>            frame-time budget for dynamic resolution, 0 for full
+     *                          resolution; 60 fps interactively, off for --bench
+     */
+    bool headless = false;
+    int bench_frames = 0;
+    bool test = false;
+    float budget_ms = -1;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--headless")) {
+            headless = true;
+        } else if (!strcmp(argv[i], "--bench")) {
+            headless = true;
+            bench_frames = i + 1 < argc && isdigit(argv[i + 1][0]) ? std::max(atoi(argv[++i]), 1) : 300;
+        } else if (!strcmp(argv[i], "--test")) {
+            headless = true;
+            test = true;
+        } else if (!strcmp(argv[i], "--budget") && i + 1 < argc) {
+            budget_ms = std::max(atof(argv[++i]), 0.0);
+        } else {
+            std::cerr << "Unknown argument: " << argv[i] << '\n';
+            return 1;
+        }
+    }
+    if (headless) {
+        screen_width = 1280;
+        screen_height = 720;
+    }
+
+    bool quit = false;
+    init(headless);
+    SDL_Event event;
+    int status = 0;
+
+    if (test) {
+        status = run_tests() ? 1 : 0;
+        quit = true;
+    }
+    if (bench_frames) {
+        g_resolution.budget_ms = std::max(budget_ms, 0.0f);
+        run_benchmarks(bench_frames);
+        quit = true;
+    }
+    // what F8 switches back to after turning it off
+    const float frame_budget_ms = budget_ms > 0 ? budget_ms : 1000.0f / 60;
+    g_resolution.budget_ms = budget_ms < 0 ? frame_budget_ms : budget_ms;
+
+    Player player(0, -.7, 0);
+
+    Scene scene;
+
+    Axes axes(0.1);
+    scene.add(&axes);
+
+    Voxel_world voxels;
+    scene.add(&voxels);
+
+    Mesh mesh("ship.obj");
+    mesh.translate(0, 0, -25.0);
+    mesh.rotate_around_point(-M_PI / 2.0f, {0.0f, 0.0f, -25.0f});
+    // the spin is kept as one angle, so nothing drifts however long it turns
+    const Mat4 ship_base = mesh.model();
+    scene.add(&mesh);
+
+    Simulation simulation(player);
+
+    while (!quit) {
+        while(SDL_PollEvent(&event) != 0) {
+            switch (event.type) {
+                case SDL_QUIT:
+                    quit = true;
+                    break;
+                case SDL_WINDOWEVENT:
+                    if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+                        screen_width = event.window.data1;
+                        screen_height = event.window.data2;
+                    }
+                    break;
+                case SDL_MOUSEMOTION:
+                    simulation.input.mouse_dx += event.motion.xrel;
+                    simulation.input.mouse_dy += event.motion.yrel;
+                    break;
+                case SDL_MOUSEBUTTONDOWN: {
+                    // cubes snap onto the surface under the crosshair, or go in front of the player if there is none in reach
+                    Ray_hit hit;
+                    bool aimed = scene.raycast(player.m_pos, player.in_front() - player.m_pos, PICK_DISTANCE, hit);
+                    Point3D place = aimed ? hit.point + hit.normal * (VOXEL_SIZE / 2) : player.in_front(1.2f);
+                    if (event.button.button == SDL_BUTTON_LEFT) {
+                        voxels.add(place, COLOR_RED);
+                    } else if (event.button.button == SDL_BUTTON_RIGHT) {
+                        voxels.add(place, COLOR_GREEN);
+                    } else if (event.button.button == SDL_BUTTON_MIDDLE) {
+                        voxels.remove(aimed && hit.drawable == &voxels ? hit.point - hit.normal * (VOXEL_SIZE / 2) : player.in_front(1.2f));
+                    }
+                    break;
+                }
+                case SDL_KEYDOWN:
+                    if (event.key.keysym.scancode == SDL_SCANCODE_F1) {
+                        axes.switch_activation();
+                    } else if (event.key.keysym.scancode == SDL_SCANCODE_F2) {
+                        g_backend = g_backend == BACKEND_SDL ? BACKEND_SOFTWARE : BACKEND_SDL;
+                        SDL_Log("Render backend: %s", backend_name(g_backend));
+                    }
+                    else if (event.key.keysym.scancode == SDL_SCANCODE_F5) {
+                        g_temporal_sort = !g_temporal_sort;
+                        SDL_Log("Temporal depth sort: %s", g_temporal_sort ? "on" : "off");
+                    } else if (event.key.keysym.scancode == SDL_SCANCODE_F7) {
+                        g_raster_threads = g_raster_threads == 1 ? 0 : 1;
+                        SDL_Log("Software rasterizer threads: %s", g_raster_threads == 1 ? "1" : "all");
+                    } else if (event.key.keysym.scancode == SDL_SCANCODE_F8) {
+                        g_resolution.budget_ms = g_resolution.budget_ms > 0 ? 0 : frame_budget_ms;
+                        SDL_Log("Dynamic resolution: %s", g_resolution.budget_ms > 0 ? "on" : "off");
+                    } else if (event.key.keysym.scancode == SDL_SCANCODE_F9) {
+                        g_occlusion_culling = !g_occlusion_culling;
+                        SDL_Log("Occlusion culling: %s", g_occlusion_culling ? "on" : "off");
+                    } else if (event.key.keysym.scancode == SDL_SCANCODE_F6) {
+                        // cycle through the vertex kernel levels this cpu supports
+                        g_simd_level = g_simd_level == SIMD_SCALAR ? g_simd_supported : (Simd_level) (g_simd_level - 1);
+                        SDL_Log("Vertex kernels: %s", simd_level_name(g_simd_level));
+                    }
+#ifdef PROFILE
+                    else if (event.key.keysym.scancode == SDL_SCANCODE_F3) {
+                        g_profiler.overlay = !g_profiler.overlay;
+                    } else if (event.key.keysym.scancode == SDL_SCANCODE_F4) {
+                        g_profiler.toggle_recording();
+                    }
+#endif
+            }
+        }
+
+        const Uint8* key_state = SDL_GetKeyboardState(NULL);
+        const SDL_Keymod mod_state = SDL_GetModState();
+        uint32_t keys = 0;
+        if (key_state[SDL_SCANCODE_D]) keys |= KEY_RIGHT;
+        if (key_state[SDL_SCANCODE_A]) keys |= KEY_LEFT;
+        if (key_state[SDL_SCANCODE_W]) keys |= KEY_FORWARD;
+        if (key_state[SDL_SCANCODE_S]) keys |= KEY_BACKWARD;
+        if (mod_state & KMOD_CTRL) keys |= KEY_DOWN;
+        if (key_state[SDL_SCANCODE_SPACE]) keys |= KEY_UP;
+        simulation.input.keys = keys;
+
+        Sim_state state = simulation.interpolated();
+        player.m_pos = state.pos;
+        player.m_vertical_view_angle = state.vertical_view_angle;
+        player.m_horizontal_view_angle = state.horizontal_view_angle;
+        mesh.set_model(Mat4::rotation_y(state.ship_spin) * ship_base);
+
+        draw_frame(scene, player);
+    }
 
     SDL_DestroyRenderer(g_renderer);
     SDL_DestroyWindow(g_window);
     SDL_Quit();
 
-    return 0;
+    return status;
 }